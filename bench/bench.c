@@ -0,0 +1,251 @@
+// microbenchmarks for the editor core: make bench
+//
+// src/main.c is compiled in whole with POUND_BENCH, which leaves out main()
+// and the terminal size query, so the kernels run here exactly as they do in
+// the editor, on generated corpora in tmpfs. results go to stdout as JSON
+// (make bench keeps them in build/bench.json), progress to stderr.
+//
+//   bench [-q]   -q runs smaller corpora, for a quick look
+
+#include "../src/main.c"
+
+struct corpus {
+  const char *name;
+  const char *ext; // picks the syntax, as for a real file
+  void (*gen)(FILE *fp, long n);
+  long n, quick;
+  const char *query; // a search that has to look through everything
+};
+
+static unsigned long seed = 42;
+
+// a small LCG so every run sees the same text
+static unsigned rnd(unsigned n) {
+  seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+  return (seed >> 33) % n;
+}
+
+static const char *words[] = {"count", "buffer", "index", "value", "node",
+                              "offset", "length", "next", "state", "result"};
+#define WORD words[rnd(sizeof(words) / sizeof(words[0]))]
+
+static void gen_c(FILE *fp, long n) {
+  for (long i = 0; i < n;) {
+    fprintf(fp, "/* %s the %s\n * of a %s */\n", WORD, WORD, WORD);
+    fprintf(fp, "static int %s_%ld(struct %s *%s, int %s) {\n", WORD, i, WORD,
+            WORD, WORD);
+    i += 3;
+    int body = 4 + rnd(20);
+    for (int j = 0; j < body; j++, i++) {
+      switch (rnd(4)) {
+      case 0:
+        fprintf(fp, "  if (%s->%s > %u) // %s\n", WORD, WORD, rnd(1000), WORD);
+        break;
+      case 1:
+        fprintf(fp, "    printf(\"%s %%d\\n\", %s[%u]);\n", WORD, WORD,
+                rnd(64));
+        break;
+      case 2:
+        fprintf(fp, "  %s = %s(%s, %s + %u);\n", WORD, WORD, WORD, WORD,
+                rnd(100));
+        break;
+      default:
+        fprintf(fp, "  for (int i = 0; i < %s; i++) { %s += i; }\n", WORD,
+                WORD);
+      }
+    }
+    fprintf(fp, "  return %s;\n}\n\n", WORD);
+    i += 3;
+  }
+}
+
+static void gen_py(FILE *fp, long n) {
+  for (long i = 0; i < n;) {
+    fprintf(fp, "class %s%ld:\n    \"\"\"%s the %s\"\"\"\n\n", WORD, i, WORD,
+            WORD);
+    i += 3;
+    int body = 4 + rnd(20);
+    for (int j = 0; j < body; j++, i++) {
+      switch (rnd(3)) {
+      case 0:
+        fprintf(fp, "    def %s(self, %s=%u):  # %s\n", WORD, WORD, rnd(100),
+                WORD);
+        break;
+      case 1:
+        fprintf(fp, "        return '%s' + str(self.%s)\n", WORD, WORD);
+        break;
+      default:
+        fprintf(fp, "        self.%s = [%s for %s in range(%u)]\n", WORD, WORD,
+                WORD, rnd(1000));
+      }
+    }
+    fprintf(fp, "\n");
+    i++;
+  }
+}
+
+// n is the length of the one line, in statements
+static void gen_min(FILE *fp, long n) {
+  for (long i = 0; i < n; i++)
+    fprintf(fp, "function %s%ld(a,b){var %s=\"%s\";return a+b*%u;}", WORD, i,
+            WORD, WORD, rnd(100));
+  fprintf(fp, "\n");
+}
+
+static void gen_log(FILE *fp, long n) {
+  static const char *level[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+  for (long i = 0; i < n; i++)
+    fprintf(fp,
+            "2024-01-%02u %02u:%02u:%02u.%03u [%s] worker-%u: %s %s took "
+            "%ums (id=%ld)\n",
+            1 + rnd(28), rnd(24), rnd(60), rnd(60), rnd(1000), level[rnd(4)],
+            rnd(16), WORD, WORD, rnd(5000), i);
+}
+
+static struct corpus corpora[] = {
+    {"c", ".c", gen_c, 1000000, 100000, "zqxjv"},
+    {"python", ".py", gen_py, 1000000, 100000, "zqxjv"},
+    {"minified", ".js", gen_min, 200000, 20000, "zqxjv"},
+    {"log", ".log", gen_log, 1000000, 100000, "zqxjv"},
+};
+
+static int first_result = 1;
+
+static void result(const char *corpus, const char *name, double ms,
+                   long items) {
+  printf("%s\n    {\"corpus\": \"%s\", \"bench\": \"%s\", \"ms\": %.3f, "
+         "\"items\": %ld}",
+         first_result ? "" : ",", corpus, name, ms, items);
+  first_result = 0;
+  fprintf(stderr, "  %-10s %-14s %10.3f ms  (%ld)\n", corpus, name, ms, items);
+}
+
+// throws the buffer away, as if the editor had just started
+static void reset() {
+  search_hl_drop();
+  for (int i = 0; i < E.nrows; i++)
+    free_row(&E.r[i]);
+  mem_free(MEM_ROWS, E.r);
+  E.r = NULL;
+  E.nrows = 0;
+  E.cur.x = E.cur.y = 0;
+  E.rowoff = E.coloff = 0;
+  E.dirty = 0;
+  E.frame.valid = 0;
+  fold_clear();
+  journal_close();
+  free(E.journal.path);
+  E.journal.path = NULL;
+  free(E.cache.path);
+  E.cache.path = NULL;
+  E.cache.hit = 0;
+}
+
+static void run(struct corpus *c, const char *dir, int quick) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/corpus%s", dir, c->ext);
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    exit(1);
+  }
+  seed = 42;
+  c->gen(fp, quick ? c->quick : c->n);
+  fclose(fp);
+
+  // the first open builds the session cache, the second one uses it
+  double t = now_ms();
+  editor_open(strdup(path));
+  result(c->name, "open", now_ms() - t, E.nrows);
+  reset();
+  t = now_ms();
+  editor_open(strdup(path));
+  result(c->name, "open_cached", now_ms() - t, E.nrows);
+
+  int rows = E.nrows < 100000 ? E.nrows : 100000;
+  t = now_ms();
+  for (int i = 0; i < rows; i++)
+    update_row(&E.r[(long)i * E.nrows / rows]);
+  result(c->name, "update_row", now_ms() - t, rows);
+
+  // a page at a time from the top, every frame drawn in full
+  int frames = 0;
+  long bytes = 0;
+  t = now_ms();
+  for (E.rowoff = 0; E.rowoff < E.nrows && frames < 2000;
+       E.rowoff += E.ws.rows, frames++) {
+    struct buffer b = BUFFER_INIT;
+    E.frame.valid = 0;
+    draw_rows(&b);
+    bytes += b.len;
+    buffer_free(&b);
+  }
+  result(c->name, "draw_rows", now_ms() - t, frames);
+  fprintf(stderr, "  %-10s %-14s %10ld bytes drawn\n", c->name, "", bytes);
+  E.rowoff = 0;
+
+  t = now_ms();
+  search_callback((char *)c->query, 'x');
+  search_callback((char *)c->query, '\r');
+  result(c->name, "search", now_ms() - t, E.nrows);
+
+  // a block of lines in the middle, put in and taken out again
+  int n = E.nrows / 10;
+  struct piece *p = malloc(sizeof(struct piece) * n);
+  for (int i = 0; i < n; i++) {
+    row *r = &E.r[i];
+    p[i] = (struct piece){r->chars, NULL, 0, r->size};
+  }
+  t = now_ms();
+  insert_pieces(E.nrows / 2, p, n);
+  result(c->name, "insert_rows", now_ms() - t, n);
+  free(p);
+  t = now_ms();
+  delete_rows(E.nrows / 2, n);
+  result(c->name, "delete_rows", now_ms() - t, n);
+
+  char out[PATH_MAX + 8];
+  snprintf(out, sizeof(out), "%s/saved%s", dir, c->ext);
+  free(E.filename);
+  E.filename = strdup(out);
+  t = now_ms();
+  save();
+  // joined without save_wait, which would draw a frame onto stdout
+  if (E.saving.active)
+    save_finish();
+  result(c->name, "save", now_ms() - t, E.nrows);
+  unlink(out);
+
+  reset();
+  unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+  int quick = argc > 1 && strcmp(argv[1], "-q") == 0;
+  char dir[] = "/dev/shm/pound-bench-XXXXXX";
+  char fallback[] = "/tmp/pound-bench-XXXXXX";
+  char *tmp = mkdtemp(dir);
+  if (tmp == NULL)
+    tmp = mkdtemp(fallback);
+  if (tmp == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+  // a cache of its own, so the first open always misses
+  char cache[PATH_MAX];
+  snprintf(cache, sizeof(cache), "%s/cache", tmp);
+  setenv("XDG_CACHE_HOME", cache, 1);
+
+  init_editor();
+  E.ttyfd = -1;
+
+  printf("{\n  \"threads\": %d,\n  \"quick\": %s,\n  \"results\": [", nthreads(),
+         quick ? "true" : "false");
+  for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+    run(&corpora[i], tmp, quick);
+  printf("\n  ]\n}\n");
+
+  char cmd[PATH_MAX + 16];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", tmp);
+  return system(cmd) == -1;
+}
@@ -1,18 +1,38 @@
-#include <X11/Xlib.h>
+#define _GNU_SOURCE
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
-#include <libclipboard.h>
 #include <locale.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef POUND_ZSTD
+#include <zstd.h>
+#endif
+#ifdef POUND_MEMSTATS
+#include <malloc.h>
+#endif
 
 #define TAB_STOP 2
 
@@ -26,7 +46,8 @@ enum editor_key {
   DEL_KEY,
   HOME_KEY,
   END_KEY,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE // a bracketed paste, the text is in E.input.paste
 };
 
 struct history {
@@ -38,6 +59,34 @@ struct window_size {
   int columns;
 };
 
+struct bracket_sum {
+  int delta; // opening minus closing brackets
+  int fmin;  // lowest running depth from the start of the row, <= 0
+};
+
+// where the highlighter stands at some column of a row
+struct hl_state {
+  int i;          // the column it goes on from
+  int in_comment; // in a multi-line comment
+  int in_string;  // the quote of the string it is in, or 0
+  int prev_sep;   // the column before i ends a word
+  int number;     // the column before i is part of a number
+  int done;       // a single line comment runs to the end of the row
+};
+
+// a piece of a long row, see // long rows
+struct row_chunk {
+  int len;
+  struct hl_state st; // at its start, with i relative to it
+  struct bracket_sum br[3];
+};
+
+// the words a row put into the index, see // completion
+struct word_row {
+  uint64_t hash; // of the text they were taken from, 0 if not indexed
+  int *ids;      // ids[0] word ids follow, NULL if there were none
+};
+
 typedef struct row {
   int idx;
 
@@ -48,6 +97,14 @@ typedef struct row {
 
   char *render;
   char *chars;
+  int *refs; // owners of chars while a register shares it, else NULL
+  int vlines; // screen lines when soft wrapped
+  struct bracket_sum br[3]; // (), [] and {}, see // brackets
+  struct row_chunk *chunks; // NULL unless the row is long, see // long rows
+  int nchunks;
+  uint64_t hash; // of chars, 0 until asked for, see // diff
+  unsigned long gen; // snapshot generation chars became its own in
+  struct word_row words;
 } row;
 
 typedef enum { NORMAL, INSERT, VISUAL } MODE;
@@ -62,6 +119,20 @@ struct select {
   struct cursor final;
 };
 
+// a slice of row text held by a register, sharing the row's buffer
+struct piece {
+  char *chars;
+  int *refs;
+  int off;
+  int len;
+};
+
+struct reg {
+  struct piece *p;
+  int n;        // pieces, one per line
+  int linewise; // whole lines, put below the cursor row
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
@@ -75,6 +146,273 @@ struct syntax {
   int flags;
 };
 
+struct buffer {
+  char *b;
+  int len;
+};
+
+struct journal {
+  int fd;
+  char *path;
+  struct stat base;
+  struct buffer pending;
+  time_t last_flush;
+  int replaying;
+  unsigned long edits; // records made so far, written or not
+};
+
+struct follow {
+  int ifd; // inotify instance, -1 while not following
+  int wd;
+  int fd;
+  ino_t ino;
+  off_t offset;  // bytes of the file already in the buffer
+  int open_line; // the last row has not seen its newline yet
+  int pending;
+  int rotated;
+};
+
+#define HOST_CLIENTS 8
+
+// the process of pound --daemon that keeps one buffer, see // daemon
+struct host {
+  int on;
+  int ctl; // the daemon hands terminals over on this, -1 once it is gone
+  int clients[HOST_CLIENTS];
+  int n;
+};
+
+// the file itself as offset, hex and ASCII columns, see // hex view
+struct hex {
+  int on;
+  int fd;
+  int writable;
+  int ascii;  // the cursor is in the ASCII column
+  int nibble; // the high half of the byte under the cursor was typed
+  int wrote;  // bytes went to the file since the view was opened
+  int buffer; // the rows hold the file as well, and go stale on a write
+  off_t size;
+  off_t top; // first byte on screen, a multiple of HEX_COLS
+  off_t cur;
+  unsigned char *map; // a window of the file around the screen
+  off_t map_off;
+  size_t map_len;
+};
+
+enum {
+  DIFF_SAME,
+  DIFF_ADD,
+  DIFF_CHANGE,
+  DIFF_DEL,       // rows were removed above this one
+  DIFF_DEL_BELOW, // the last row, rows were removed below it
+};
+
+struct diff {
+  int on;
+  int stale; // the buffer changed since the last run was started
+  int tell;  // put the counts in the status bar once the run is in
+  int running;
+  int done; // set by the worker once next is filled in
+  int err;
+  pthread_t thread;
+  char *path;
+  struct stat st;  // of the file when it was hashed
+  uint64_t *disk;  // a hash per line of the file
+  int ndisk;
+  uint64_t *rows; // a hash per row, as they were when the run started
+  int nrows;
+  unsigned char *marks; // DIFF_* per row, from the last run that finished
+  unsigned char *next;  // what the running one comes up with
+  int nmarks;
+  int added, changed, removed;
+  unsigned long built; // bumped whenever what the gutter shows changes
+};
+
+enum { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD };
+
+struct saving {
+  int active;
+  int done; // set by the writer once it is through
+  int err;  // errno of what went wrong, 0 if it worked
+  pthread_t thread;
+  char *path;
+  int compress;
+  struct piece *p; // the rows as they were, see // snapshots
+  int n;
+  unsigned long gen; // of the snapshot
+  unsigned long edits; // E.journal.edits when they were taken
+  off_t mark;          // how long the journal was then
+  long total;          // bytes of text
+  long written;        // of those handed to the file so far
+  int shown;           // percentage the status bar shows
+  off_t size;          // of the file written
+};
+
+#define SNAP_MAX 4
+
+// row text let go of while a snapshot may still be reading it
+struct retired {
+  char *chars;
+  int *refs;
+  unsigned long gen;
+};
+
+struct snaps {
+  unsigned long gen;            // of text rows come to own from now on
+  unsigned long live[SNAP_MAX]; // generations of the snapshots being read
+  int n;
+  struct retired *old;
+  int nold, cap;
+};
+
+struct word {
+  int off; // of its text in words.text
+  int len;
+  int count; // how often it occurs in the buffer
+  uint32_t hash;
+};
+
+struct completion {
+  int active;
+  int y, x; // where the word being completed starts
+  int len;  // of what is there now
+  char *prefix;
+  int plen;
+  int *ids; // the candidates, most frequent first
+  int n;
+  int pick; // candidate in the row, n for the prefix itself
+};
+
+struct words {
+  int built;
+  int all; // every row has to be looked at, not just the changed ones
+  unsigned long version; // of E.changes when the rows were last indexed
+  struct word *w;
+  int nw, cap;
+  int *slots; // hash table of ids, -1 where empty
+  int nslots;
+  char *text; // the words, each once
+  int ntext, textcap;
+  int *sorted; // ids in word order
+  int nsorted;
+  int *fresh; // ids not merged into sorted yet
+  int nfresh, freshcap;
+  int *tmp; // ids of the row being indexed
+  int ntmp;
+  // the build, from a snapshot of the rows
+  int running;
+  int done; // set by the builder once it is through
+  pthread_t thread;
+  struct piece *snap;
+  struct word_row *made; // what the builder made of each snapshot row
+  int nsnap;
+  unsigned long gen; // of the snapshot
+  struct completion comp;
+};
+
+struct chunk {
+  struct chunk *next;
+  size_t len;
+  char data[];
+};
+
+struct stream {
+  int active;
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  struct chunk *head;
+  struct chunk *tail;
+  size_t queued; // bytes sitting in the queue
+  size_t bytes;  // bytes already turned into rows
+  int eof;
+  int err;
+  int open_line;
+};
+
+#define CHANGE_LOG 256
+#define CHANGE_SUBS 8
+
+struct change {
+  unsigned long version;
+  int kind; // CHANGE_*
+  int lo;
+  int hi;
+};
+
+struct changes {
+  unsigned long version;
+  unsigned long floor; // newest version that fell out of the log
+  struct change log[CHANGE_LOG];
+  int head;
+  int n;
+  void (*subs[CHANGE_SUBS])(const struct change *);
+  int nsubs;
+};
+
+struct cache {
+  char *path; // NULL if the file isn't cached
+  int hit;
+  struct cursor cur; // where the cursor and view were left last time
+  int rowoff, coloff;
+};
+
+struct input {
+  struct buffer paste;
+  struct buffer ahead; // read past the end of a paste, handed out first
+  int ahead_at;
+};
+
+// what the screen showed last time, see draw_rows. anything in view that
+// differs from the last frame means every line is drawn again
+struct frame {
+  int valid;
+  unsigned long version; // of E.changes when it was drawn
+  int cur_y;
+  int bracket_y;
+  struct view {
+    int rowoff, coloff, sub, wrap, width, rows, columns, gutter, empty;
+    unsigned long folds, diff;
+    MODE mode;
+    void *syntax;
+  } view;
+};
+
+struct fold {
+  int start;
+  int end;
+  int closed;
+};
+
+struct span {
+  int start;
+  int end;
+  int before; // hidden rows in front of this span
+};
+
+struct folds {
+  struct fold *f; // sorted by start once built
+  int n;
+  int *maxend;         // interval tree over f, see fold_tree
+  struct span *hidden; // rows hidden by closed folds, merged
+  int nhidden;
+  int stale;
+  unsigned long built; // bumped by every fold_build
+};
+
+struct wrap {
+  int on;
+  int width; // text columns the line counts were made for
+  int stale; // the counts of every row have to be made again
+  int valid; // tree entries 1..valid cover rows that haven't moved
+  int n;     // rows the tree covers
+  int *tree; // 1-based fenwick tree over row->vlines
+  int sub;   // screen lines of E.rowoff scrolled off the top
+  int cy;    // cursor position on screen, set by wrap_scroll
+  int cx;
+};
+
 struct editor_config {
   struct termios orig_termios;
   struct window_size ws;
@@ -85,7 +423,16 @@ struct editor_config {
   int nrows;
   char *filename;
   int rowoff;
-  char *reg;
+  struct reg reg[27]; // the unnamed register, then a-z
+  int regname;        // register picked with ", 0 if none
+  int count;          // count typed in front of a normal mode command
+  struct wrap wrap;
+  struct folds folds;
+  struct cursor bracket; // match of the bracket under the cursor, y = -1 if none
+  struct changes changes;
+  struct frame frame;
+  struct input input;
+  struct cache cache;
   struct select *select;
   int coloff;
   row *r;
@@ -93,6 +440,18 @@ struct editor_config {
   MODE mode;
   int dirty;
   struct syntax *syntax;
+  struct journal journal;
+  struct follow follow;
+  struct hex hex;
+  struct diff diff;
+  struct saving saving;
+  struct snaps snaps;
+  struct words words;
+  struct host host;
+  struct stream stream;
+  int compress; // COMPRESS_* the file was stored with, kept on save
+  int ttyfd;   // keys are read from here; /dev/tty when stdin is a pipe
+  int wake[2]; // background threads poke read_key through this pipe
 };
 
 enum editorHighlight {
@@ -131,17 +490,41 @@ struct syntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
-struct buffer {
-  char *b;
-  int len;
-};
-
 void refresh_screen();
 char *start_prompt(char *prompt, void (*callback)(char *, int));
 void del_row(int at);
 void update_syntax(row *r);
 void update_row(row *r);
 void insert_char(int c);
+void journal_tick();
+int editor_idle();
+void hex_draw(struct buffer *b);
+void hex_cursor(int *y, int *x);
+void vim_prompt();
+int host_wait(int timeout);
+void host_detach(int fd);
+int diff_mark(int y);
+int sort_rows(int lo, int hi, int flags);
+void save_wait();
+void editor_wake();
+void journal_rebase(off_t mark);
+void diff_changed(const struct change *ch);
+int words_poll();
+void words_clear();
+void words_drop(struct word_row *wr);
+
+#define IDLE_REDRAW (1 << 0)
+#define IDLE_BUSY (1 << 1)
+void row_del_range(row *r, int at, int n);
+int open_compressed(int fd);
+char *compress_buffer(char *buf, int len, int *outlen);
+void append_string(row *r, char *s, size_t len);
+void search_hl_drop();
+void search_hl_restore();
+void status_message(const char *fmt, ...);
+int bracket_match(int y, int x, struct cursor *match);
+int editable();
+void cache_leave();
 // buffer methods
 
 void buffer_append(struct buffer *buf, const char *s, int len) {
@@ -164,14 +547,144 @@ void buffer_free(struct buffer *buf) { free(buf->b); }
 
 struct editor_config E;
 
+// memory accounting
+
+/* built with make MEMSTATS=1, the allocations that make up the buffer go
+ * through these wrappers, which charge their usable size to a category; :mem
+ * reports what each holds now and at most. otherwise they are plain
+ * malloc/realloc/free and nothing is counted. rows are built from several
+ * threads, hence the atomics. */
+enum mem_category {
+  MEM_CHARS,  // row text, also when a register shares it
+  MEM_RENDER, // rows with tabs expanded
+  MEM_HL,     // highlighting
+  MEM_META,   // share counts and indexes over the rows
+  MEM_ROWS,   // the E.r array
+  MEM_FRAME,  // the screen being drawn
+  MEM_SEARCH, // highlighting a search match covers up
+  MEM_CATEGORIES
+};
+
+#ifdef POUND_MEMSTATS
+struct {
+  long live[MEM_CATEGORIES + 1]; // the last one is the total
+  long peak[MEM_CATEGORIES + 1];
+} mem;
+
+void mem_raise(long *peak, long v) {
+  long p = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (v > p && !__atomic_compare_exchange_n(peak, &p, v, 1,
+                                               __ATOMIC_RELAXED,
+                                               __ATOMIC_RELAXED))
+    ;
+}
+
+void mem_count(int cat, long n) {
+  mem_raise(&mem.peak[cat],
+            __atomic_add_fetch(&mem.live[cat], n, __ATOMIC_RELAXED));
+  mem_raise(&mem.peak[MEM_CATEGORIES],
+            __atomic_add_fetch(&mem.live[MEM_CATEGORIES], n,
+                               __ATOMIC_RELAXED));
+}
+
+void *mem_malloc(int cat, size_t n) {
+  void *p = malloc(n);
+  if (p)
+    mem_count(cat, malloc_usable_size(p));
+  return p;
+}
+
+void *mem_realloc(int cat, void *p, size_t n) {
+  long before = p ? malloc_usable_size(p) : 0;
+  void *q = realloc(p, n);
+  // a failed realloc leaves p alone, realloc to 0 frees it
+  if (q || n == 0)
+    mem_count(cat, (q ? (long)malloc_usable_size(q) : 0) - before);
+  return q;
+}
+
+void mem_free(int cat, void *p) {
+  if (p)
+    mem_count(cat, -(long)malloc_usable_size(p));
+  free(p);
+}
+
+// 1234567 -> "1.2M"
+char *mem_size(char *out, long n) {
+  const char *unit = "BKMGT";
+  double v = n;
+  while (v >= 1024 && unit[1]) {
+    v /= 1024;
+    unit++;
+  }
+  sprintf(out, v < 10 && *unit != 'B' ? "%.1f%c" : "%.0f%c", v, *unit);
+  return out;
+}
+
+// :mem shows what is live, :mem peak the most each category held at once
+void mem_report(int peak) {
+  static const char *names[] = {"chars", "render", "hl",    "meta",
+                                "rows",  "frame",  "search"};
+  long *v = peak ? mem.peak : mem.live;
+  char msg[sizeof(E.statusmsg)], n[16];
+  int len = snprintf(msg, sizeof(msg), "%s", peak ? "peak " : "");
+  for (int i = 0; i <= MEM_CATEGORIES && len < (int)sizeof(msg); i++) {
+    // nothing is drawing while the report is made
+    if (i == MEM_FRAME && !peak)
+      continue;
+    if (i == MEM_CATEGORIES)
+      len += snprintf(msg + len, sizeof(msg) - len, " = %s", mem_size(n, v[i]));
+    else
+      len += snprintf(msg + len, sizeof(msg) - len, "%s%s %s", i ? " " : "",
+                      names[i], mem_size(n, v[i]));
+  }
+  status_message("%s", msg);
+}
+#else
+#define mem_malloc(cat, n) malloc(n)
+#define mem_realloc(cat, p, n) realloc(p, n)
+#define mem_free(cat, p) free(p)
+#define mem_count(cat, n)
+#define mem_report(peak)                                                       \
+  status_message("Memory isn't counted in this build, see make MEMSTATS=1")
+#endif
+
+int write_all(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, s, len, MSG_NOSIGNAL);
+    // send only takes sockets
+    if (n == -1 && errno == ENOTSOCK)
+      n = write(fd, s, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// everything meant for the screen goes through here; the buffer process of a
+// daemon sends it to every terminal attached to it
+void term_write(const char *s, size_t len) {
+  if (!E.host.on) {
+    write(STDOUT_FILENO, s, len);
+    return;
+  }
+  for (int i = 0; i < E.host.n; i++)
+    write_all(E.host.clients[i], s, len);
+}
+
 void die(const char *s) {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  term_write("\x1b[2J", 4);
+  term_write("\x1b[H", 3);
   exit(1);
 }
 
 void disable_raw_mode() {
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
+  if (tcsetattr(E.ttyfd, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
 
@@ -208,13 +721,10 @@ int findn(int num) {
   return (int)log10(num) + 1;
 }
 
-char *pad_with_zeros(int number, int digits) {
-  char *result = (char *)malloc(digits + 1); // +1 for the null terminator
-  sprintf(result, "%0*d", digits, number);
-  return result;
-}
-
 int ctrx(row *r, int cx) {
+  // long rows have no tabs, see row_chunks
+  if (r->chunks)
+    return cx;
   int rx = 0;
   int j;
   for (j = 0; j < cx; j++) {
@@ -226,6 +736,8 @@ int ctrx(row *r, int cx) {
 }
 
 int rtcx(row *r, int rx) {
+  if (r->chunks)
+    return rx < r->size ? rx : r->size;
   int currx = 0;
   int cx;
   for (cx = 0; cx < r->size; cx++) {
@@ -239,26 +751,541 @@ int rtcx(row *r, int rx) {
   return cx;
 }
 
+// change feed
+
+/* every change to the rows bumps E.changes.version and is logged as a range
+ * of rows, so anything that caches per-row work (the screen, indexes) can
+ * ask what changed since the version it last saw instead of redoing it all.
+ * the log is a ring; neighbouring row ranges are merged into one entry, and
+ * asking about a version older than the ring still holds gets "everything".
+ * subscribers are told about each change as it happens. */
+
+enum change_kind {
+  CHANGE_ROWS,   // rows lo..hi changed in place
+  CHANGE_INSERT, // rows lo..hi are new, the ones below moved down
+  CHANGE_DELETE, // rows lo..hi (numbered before) are gone, the rest moved up
+};
+
+void change_note(int kind, int lo, int hi) {
+  struct changes *c = &E.changes;
+  c->version++;
+  struct change ch = {c->version, kind, lo, hi};
+  for (int i = 0; i < c->nsubs; i++)
+    c->subs[i](&ch);
+
+  struct change *last =
+      c->n ? &c->log[(c->head + CHANGE_LOG - 1) % CHANGE_LOG] : NULL;
+  if (last && kind == last->kind && kind != CHANGE_DELETE &&
+      lo <= last->hi + 1 && (kind == CHANGE_INSERT || hi >= last->lo - 1)) {
+    last->lo = lo < last->lo ? lo : last->lo;
+    last->hi = hi > last->hi ? hi : last->hi;
+    last->version = c->version;
+    return;
+  }
+  if (c->n == CHANGE_LOG)
+    c->floor = c->log[c->head].version;
+  else
+    c->n++;
+  c->log[c->head] = ch;
+  c->head = (c->head + 1) % CHANGE_LOG;
+}
+
+// the rows that changed after version v, as one range: 0 if none, 1 if
+// *lo..*hi (hi = INT_MAX when rows moved), -1 if v is too old to tell
+int changes_since(unsigned long v, int *lo, int *hi) {
+  struct changes *c = &E.changes;
+  if (v == c->version)
+    return 0;
+  if (v < c->floor)
+    return -1;
+  *lo = INT_MAX;
+  *hi = -1;
+  for (int i = 0; i < c->n; i++) {
+    struct change *ch = &c->log[(c->head + CHANGE_LOG - 1 - i) % CHANGE_LOG];
+    if (ch->version <= v)
+      continue;
+    if (ch->lo < *lo)
+      *lo = ch->lo;
+    int h = ch->kind == CHANGE_ROWS ? ch->hi : INT_MAX;
+    if (h > *hi)
+      *hi = h;
+  }
+  return 1;
+}
+
+void change_subscribe(void (*fn)(const struct change *)) {
+  if (E.changes.nsubs < CHANGE_SUBS)
+    E.changes.subs[E.changes.nsubs++] = fn;
+}
+
+// folds
+
+/* a fold covers rows start..end; closed, everything below its first row is
+ * hidden. folds live in an array sorted by start that doubles as an interval
+ * tree: the middle of every range is a node, and maxend holds the furthest
+ * end under it, so finding the folds around a row is O(log n). the rows that
+ * closed folds hide are also kept merged into disjoint ranges, with the
+ * number of hidden rows in front of each, so stepping over them or counting
+ * visible rows is a binary search and never touches the hidden rows. */
+int fold_cmp(const void *a, const void *b) {
+  const struct fold *x = a, *y = b;
+  return x->start != y->start ? x->start - y->start : y->end - x->end;
+}
+
+int fold_tree(int lo, int hi) {
+  if (lo >= hi)
+    return -1;
+  int mid = (lo + hi) / 2;
+  int m = E.folds.f[mid].end;
+  int l = fold_tree(lo, mid), r = fold_tree(mid + 1, hi);
+  if (l > m)
+    m = l;
+  if (r > m)
+    m = r;
+  E.folds.maxend[mid] = m;
+  return m;
+}
+
+void fold_build() {
+  struct folds *fs = &E.folds;
+  fs->built++;
+  qsort(fs->f, fs->n, sizeof(struct fold), fold_cmp);
+  fs->maxend = realloc(fs->maxend, sizeof(int) * (fs->n + 1));
+  fold_tree(0, fs->n);
+  fs->nhidden = 0;
+  fs->hidden = realloc(fs->hidden, sizeof(struct span) * (fs->n + 1));
+  int skipped = 0;
+  for (int i = 0; i < fs->n; i++) {
+    struct fold *f = &fs->f[i];
+    if (!f->closed || f->end <= f->start)
+      continue;
+    struct span *h = fs->nhidden ? &fs->hidden[fs->nhidden - 1] : NULL;
+    // a fold starting inside (or right at the end of) what is already
+    // hidden just extends it
+    if (h && f->start <= h->end) {
+      if (f->end > h->end) {
+        skipped += f->end - h->end;
+        h->end = f->end;
+      }
+      continue;
+    }
+    h = &fs->hidden[fs->nhidden++];
+    h->start = f->start + 1;
+    h->end = f->end;
+    h->before = skipped;
+    skipped += h->end - h->start + 1;
+  }
+  fs->stale = 0;
+  E.wrap.stale = 1;
+}
+
+// the last hidden span starting at or before y, or -1
+int fold_range(int y) {
+  struct folds *fs = &E.folds;
+  if (fs->stale)
+    fold_build();
+  int lo = 0, hi = fs->nhidden;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (fs->hidden[mid].start <= y)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+int fold_hidden(int y) {
+  int k = fold_range(y);
+  return k >= 0 && y <= E.folds.hidden[k].end;
+}
+
+// the row a hidden y is shown as: the first row of the fold hiding it
+int fold_visible(int y) {
+  int k = fold_range(y);
+  if (k >= 0 && y <= E.folds.hidden[k].end)
+    return E.folds.hidden[k].start - 1;
+  return y;
+}
+
+// the visible rows after and before y
+int fold_next(int y) {
+  int k = fold_range(y + 1);
+  if (k >= 0 && y + 1 <= E.folds.hidden[k].end)
+    return E.folds.hidden[k].end + 1;
+  return y + 1;
+}
+
+int fold_prev(int y) { return fold_visible(y - 1); }
+
+// how many visible rows come before y, and back
+int fold_count(int y) {
+  int k = fold_range(y - 1);
+  if (k < 0)
+    return y;
+  struct span *h = &E.folds.hidden[k];
+  int end = h->end < y - 1 ? h->end : y - 1;
+  return y - h->before - (end - h->start + 1);
+}
+
+int fold_row(int v) {
+  struct folds *fs = &E.folds;
+  if (fs->stale)
+    fold_build();
+  int lo = 0, hi = fs->nhidden;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (fs->hidden[mid].start - fs->hidden[mid].before <= v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return v;
+  struct span *h = &fs->hidden[lo - 1];
+  return v + h->before + (h->end - h->start + 1);
+}
+
+// the innermost fold around y, or -1; open ones only if closed is 0, closed
+// ones only if it is 1, either with -1
+void fold_stab(int lo, int hi, int y, int closed, int *best) {
+  struct folds *fs = &E.folds;
+  if (lo >= hi)
+    return;
+  int mid = (lo + hi) / 2;
+  if (fs->maxend[mid] < y)
+    return;
+  fold_stab(lo, mid, y, closed, best);
+  struct fold *f = &fs->f[mid];
+  if (f->start > y)
+    return;
+  if (y <= f->end && (closed == -1 || f->closed == closed)) {
+    if (*best == -1 || f->start > fs->f[*best].start ||
+        (f->start == fs->f[*best].start && f->end < fs->f[*best].end))
+      *best = mid;
+  }
+  fold_stab(mid + 1, hi, y, closed, best);
+}
+
+int fold_at(int y, int closed) {
+  if (E.folds.stale)
+    fold_build();
+  int best = -1;
+  fold_stab(0, E.folds.n, y, closed, &best);
+  return best;
+}
+
+void fold_add(int start, int end, int closed) {
+  struct folds *fs = &E.folds;
+  if (end <= start)
+    return;
+  fs->f = realloc(fs->f, sizeof(struct fold) * (fs->n + 1));
+  fs->f[fs->n].start = start;
+  fs->f[fs->n].end = end;
+  fs->f[fs->n].closed = closed;
+  fs->n++;
+  fs->stale = 1;
+}
+
+void fold_clear() {
+  E.folds.n = 0;
+  E.folds.stale = 1;
+}
+
+// keeps folds on the same text when n rows are inserted (n > 0) or deleted
+// (n < 0) at at
+void fold_shift(int at, int n) {
+  struct folds *fs = &E.folds;
+  if (fs->n == 0)
+    return;
+  int w = 0;
+  for (int i = 0; i < fs->n; i++) {
+    struct fold f = fs->f[i];
+    if (n > 0) {
+      if (f.start >= at)
+        f.start += n;
+      if (f.end >= at)
+        f.end += n;
+    } else {
+      int gone = at - n;
+      f.start = f.start < at ? f.start : f.start >= gone ? f.start + n : at;
+      f.end = f.end < at ? f.end : f.end >= gone ? f.end + n : at - 1;
+      if (f.end <= f.start)
+        continue;
+    }
+    fs->f[w++] = f;
+  }
+  fs->n = w;
+  fs->stale = 1;
+}
+
+// folds every {} block, going by the highlighting to skip strings and comments
+void fold_braces() {
+  int *open = NULL;
+  int depth = 0, cap = 0;
+  for (int y = 0; y < E.nrows; y++) {
+    row *r = &E.r[y];
+    for (int j = 0; j < r->rsize; j++) {
+      if (r->hl[j] == HL_STRING || r->hl[j] == HL_COMMENT ||
+          r->hl[j] == HL_MLCOMMENT)
+        continue;
+      if (r->render[j] == '{') {
+        if (depth == cap) {
+          cap = cap ? cap * 2 : 64;
+          open = realloc(open, sizeof(int) * cap);
+        }
+        open[depth++] = y;
+      }
+      else if (r->render[j] == '}' && depth > 0)
+        fold_add(open[--depth], y, 1);
+    }
+  }
+  free(open);
+}
+
+int indent_of(row *r) {
+  int i = 0;
+  while (i < r->rsize && r->render[i] == ' ')
+    i++;
+  return i == r->rsize ? -1 : i;
+}
+
+// a row with lines indented deeper than it below folds over all of them;
+// blank lines go with whatever surrounds them
+void fold_indent() {
+  int *stack = malloc(sizeof(int) * (E.nrows + 1));
+  int top = 0, last = -1;
+  for (int y = 0; y <= E.nrows; y++) {
+    int ind = y < E.nrows ? indent_of(&E.r[y]) : 0;
+    if (ind == -1)
+      continue;
+    while (top > 0 && indent_of(&E.r[stack[top - 1]]) >= ind)
+      fold_add(stack[--top], last, 1);
+    if (y < E.nrows)
+      stack[top++] = y;
+    last = y;
+  }
+  free(stack);
+}
+
+void fold_command(int c) {
+  int at = E.cur.y;
+  int k = -1;
+  switch (c) {
+  case 'o':
+    k = fold_at(at, 1);
+    if (k != -1)
+      E.folds.f[k].closed = 0;
+    break;
+  case 'c':
+    k = fold_at(at, 0);
+    if (k != -1)
+      E.folds.f[k].closed = 1;
+    break;
+  case 'a':
+    k = fold_at(at, -1);
+    if (k != -1)
+      E.folds.f[k].closed = !E.folds.f[k].closed;
+    break;
+  case 'd':
+    k = fold_at(at, -1);
+    if (k != -1)
+      E.folds.f[k] = E.folds.f[--E.folds.n];
+    break;
+  case 'R':
+  case 'M':
+    for (int i = 0; i < E.folds.n; i++)
+      E.folds.f[i].closed = c == 'M';
+    k = 0;
+    break;
+  case 'E':
+    fold_clear();
+    k = 0;
+    break;
+  default:
+    status_message("z%c is undefined", c);
+    return;
+  }
+  if (k == -1 && E.folds.n > 0)
+    status_message("No fold found");
+  E.folds.stale = 1;
+  E.cur.y = fold_visible(E.cur.y);
+}
+
+// columns left for text next to the line numbers
+int text_width() {
+  int w = E.ws.columns - findn(E.nrows) - 1;
+  return w > 0 ? w : 1;
+}
+
+// soft wrap
+
+/* with :set wrap, long rows carry on over the next screen lines instead of
+ * scrolling sideways. every row caches how many screen lines it takes
+ * (row->vlines) and a fenwick tree over those counts maps screen lines to
+ * rows and back in O(log n). an edit within a row is a point update. a
+ * fenwick tree can't take rows in the middle, so rows coming or going only
+ * note the first row that moved, and before the tree is next looked at the
+ * entries from there on are made again. that is a pass over the rows below
+ * the change: cheap at the end of a file, but Enter or dd near the top of a
+ * huge wrapped one still costs O(n). */
+int wrap_count(row *r) {
+  if (fold_hidden(r - E.r))
+    return 0;
+  return r->rsize ? (r->rsize + E.wrap.width - 1) / E.wrap.width : 1;
+}
+
+// rows from at on were added, removed or moved
+void wrap_moved(int at) {
+  if (at < E.wrap.valid)
+    E.wrap.valid = at;
+}
+
+void wrap_build() {
+  struct wrap *w = &E.wrap;
+  int from = w->valid < w->n ? w->valid : w->n;
+  if (w->stale || w->width != text_width() || from > E.nrows)
+    from = 0;
+  w->width = text_width();
+  w->n = E.nrows;
+  w->tree = mem_realloc(MEM_META, w->tree, sizeof(int) * (w->n + 1));
+  for (int i = from + 1; i <= w->n; i++) {
+    row *r = &E.r[i - 1];
+    r->vlines = wrap_count(r);
+    w->tree[i] = r->vlines;
+  }
+  // the entries left alone that have a parent past from are the ones a
+  // prefix sum up to from visits
+  for (int j = from; j > 0; j -= j & -j) {
+    int parent = j + (j & -j);
+    if (parent <= w->n)
+      w->tree[parent] += w->tree[j];
+  }
+  for (int i = from + 1; i <= w->n; i++) {
+    int parent = i + (i & -i);
+    if (parent <= w->n)
+      w->tree[parent] += w->tree[i];
+  }
+  w->stale = 0;
+  w->valid = w->n;
+}
+
+// brings the tree up to date before it is looked at
+void wrap_fresh() {
+  struct wrap *w = &E.wrap;
+  if (w->stale || w->valid < E.nrows || w->n != E.nrows ||
+      w->width != text_width())
+    wrap_build();
+}
+
+// called whenever a row's render changed
+void wrap_update(row *r) {
+  struct wrap *w = &E.wrap;
+  if (!w->on || w->stale || r - E.r >= w->valid)
+    return;
+  int v = wrap_count(r);
+  int delta = v - r->vlines;
+  r->vlines = v;
+  for (int i = r - E.r + 1; delta && i <= w->n; i += i & -i)
+    w->tree[i] += delta;
+}
+
+// screen lines taken by the rows before at
+int wrap_prefix(int at) {
+  int sum = 0;
+  for (int i = at; i > 0; i -= i & -i)
+    sum += E.wrap.tree[i];
+  return sum;
+}
+
+// the row screen line v falls in, and which of its lines it is
+int wrap_find(int v, int *sub) {
+  struct wrap *w = &E.wrap;
+  int at = 0;
+  int step = 1;
+  while (step * 2 <= w->n)
+    step *= 2;
+  for (; step; step /= 2) {
+    if (at + step <= w->n && w->tree[at + step] <= v) {
+      at += step;
+      v -= w->tree[at];
+    }
+  }
+  *sub = v;
+  return at;
+}
+
+void wrap_scroll() {
+  struct wrap *w = &E.wrap;
+  wrap_fresh();
+  E.coloff = 0;
+  int top = E.rowoff < E.nrows ? wrap_prefix(E.rowoff) + w->sub
+                               : wrap_prefix(E.nrows);
+  int cur = wrap_prefix(E.cur.y < E.nrows ? E.cur.y : E.nrows);
+  int sub = 0;
+  if (E.cur.y < E.nrows) {
+    sub = E.rx / w->width;
+    if (sub >= E.r[E.cur.y].vlines)
+      sub = E.r[E.cur.y].vlines - 1;
+    cur += sub;
+  }
+  if (cur < top)
+    top = cur;
+  if (cur >= top + E.ws.rows)
+    top = cur - E.ws.rows + 1;
+  E.rowoff = wrap_find(top, &w->sub);
+  w->cy = cur - top;
+  w->cx = E.rx - sub * w->width;
+}
+
+// moves the cursor a screen up or down, in screen lines
+void wrap_page(int key) {
+  struct wrap *w = &E.wrap;
+  if (E.nrows == 0)
+    return;
+  wrap_fresh();
+  int cur = wrap_prefix(E.cur.y < E.nrows ? E.cur.y : E.nrows - 1);
+  cur += key == PAGE_UP ? -E.ws.rows : E.ws.rows;
+  int sub;
+  if (cur < 0)
+    cur = 0;
+  E.cur.y = wrap_find(cur, &sub);
+  if (E.cur.y >= E.nrows)
+    E.cur.y = E.nrows - 1;
+  E.cur.x = rtcx(&E.r[E.cur.y], sub * w->width);
+}
+
 void scroll() {
 
+  // never leave the cursor or the top row inside a closed fold
+  E.cur.y = fold_visible(E.cur.y);
+  E.rowoff = fold_visible(E.rowoff);
+
   E.rx = 0;
   if (E.cur.y < E.nrows) {
     E.rx = ctrx(&E.r[E.cur.y], E.cur.x);
   }
 
-  // Vertical Scrolling
-  if (E.cur.y < E.rowoff) {
+  if (E.wrap.on) {
+    wrap_scroll();
+    return;
+  }
+
+  // Vertical Scrolling, in visible rows
+  int cur = fold_count(E.cur.y);
+  int top = fold_count(E.rowoff);
+  if (cur < top) {
     E.rowoff = E.cur.y;
   }
-  if (E.cur.y >= E.rowoff + E.ws.rows) {
-    E.rowoff = E.cur.y - E.ws.rows + 1;
+  if (cur >= top + E.ws.rows) {
+    E.rowoff = fold_row(cur - E.ws.rows + 1);
   }
   // Horizontal Scrolling
   if (E.rx < E.coloff) {
     E.coloff = E.rx;
   }
-  if (E.rx >= E.coloff + E.ws.columns) {
-    E.coloff = E.rx - E.ws.columns + 1;
+  if (E.rx >= E.coloff + text_width()) {
+    E.coloff = E.rx - text_width() + 1;
   }
 }
 
@@ -336,18 +1363,32 @@ void status_bar(struct buffer *b) {
     normal = "\x1b[043m\x1b[30m VISUAL \x1b[0m";
     normal_end = "\x1b[43m \x1b[0m";
   }
-  char status[160], rstatus[10];
+  char status[200], rstatus[10];
   char cwd[100];
   if (getcwd(cwd, sizeof(cwd)) == NULL) {
     strcpy(cwd, "Too large");
   }
   char *path = shorten_path(cwd);
   char *devicon = get_devicon();
+  char progress[32] = "";
+  if (E.stream.active)
+    snprintf(progress, sizeof(progress), " \x1b[33m%.1f MB…\x1b[0m",
+             E.stream.bytes / 1048576.0);
+  else if (E.saving.active)
+    snprintf(progress, sizeof(progress), " \x1b[33msaving %d%%\x1b[0m",
+             E.saving.shown < 0 ? 0 : E.saving.shown);
+  char where[48];
+  if (E.hex.on)
+    snprintf(where, sizeof(where), "0x%llx %d%%",
+             (unsigned long long)E.hex.cur,
+             E.hex.size ? (int)(E.hex.cur * 100 / E.hex.size) : 0);
+  else
+    snprintf(where, sizeof(where), "%d/%d", E.cur.y + 1, E.nrows);
   int len = snprintf(status, sizeof(status),
-                     "%s %s%.20s \x1b[30m | \x1b[39m %s \x1b[34m   \x1b[0m "
-                     "\x1b[40m %d/%d \x1b[0m%s",
-                     normal, devicon, E.filename ? E.filename : "Pound", path,
-                     E.cur.y + 1, E.nrows, normal_end);
+                     "%s %s%.20s%s \x1b[30m | \x1b[39m %s \x1b[34m   \x1b[0m "
+                     "\x1b[40m %s \x1b[0m%s",
+                     normal, devicon, E.filename ? E.filename : "Pound",
+                     progress, path, where, normal_end);
   int rlen = snprintf(rstatus, sizeof(rstatus), " ");
   if (len > E.ws.columns)
     len = E.ws.columns;
@@ -362,6 +1403,7 @@ void status_bar(struct buffer *b) {
       len++;
     }
   }
+  buffer_append(b, "\x1b[K", 3);
   buffer_append(b, "\r\n", 2);
 }
 
@@ -390,14 +1432,21 @@ void detect() {
   E.syntax = NULL;
   if (E.filename == NULL)
     return;
-  char *ext = strrchr(E.filename, '.');
+  char name[strlen(E.filename) + 1];
+  strcpy(name, E.filename);
+  char *ext = strrchr(name, '.');
+  // foo.c.gz is highlighted like foo.c
+  if (ext && E.compress) {
+    *ext = '\0';
+    ext = strrchr(name, '.');
+  }
   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
     struct syntax *s = &HLDB[j];
     unsigned int i = 0;
     while (s->filematch[i]) {
       int is_ext = (s->filematch[i][0] == '.');
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+          (!is_ext && strstr(name, s->filematch[i]))) {
         E.syntax = s;
         int filerow;
         for (filerow = 0; filerow < E.nrows; filerow++) {
@@ -411,209 +1460,201 @@ void detect() {
   }
 }
 
-void draw_rows(struct buffer *b) {
-  int y;
-  for (y = 0; y < E.ws.rows; y++) {
-    int filerow = y + E.rowoff;
-    if (filerow >= E.nrows) {
-      if (E.nrows == 0 && y == E.ws.rows / 2) {
-        for (size_t i = 0;
-             i < sizeof(dashboard_lines) / sizeof(dashboard_lines[0]); i++) {
-          dashboard_insert_line(dashboard_lines[i], b);
-        }
-      }
-    } else {
-      char line_number[findn(E.nrows) + 1];
-      char *hex = "\x1b[30m";
-      if (y + E.rowoff + 1 == E.cur.y + 1) {
-        hex = "\x1b[37m";
-      }
-      sprintf(line_number, "%s%s\x1b[0m ", hex,
-              pad_with_zeros(y + E.rowoff + 1, findn(E.nrows)));
-      buffer_append(b, line_number, findn(E.nrows) + 10);
-      int len = E.r[filerow].rsize - E.coloff;
-      if (len < 0)
-        len = 0;
-      if (len > E.ws.columns)
-        len = E.ws.columns;
+void draw_gutter(struct buffer *b, int filerow, int number) {
+  int digits = findn(E.nrows);
+  if (!number) {
+    for (int i = 0; i <= digits; i++)
+      buffer_append(b, " ", 1);
+    return;
+  }
+  char line_number[digits + 16];
+  char *hex = "\x1b[30m";
+  if (filerow == E.cur.y) {
+    hex = "\x1b[37m";
+  }
+  int len = snprintf(line_number, sizeof(line_number), "%s%0*d\x1b[0m", hex,
+                     digits, filerow + 1);
+  buffer_append(b, line_number, len);
+  // :diff puts its marker where the space after the number goes
+  static const char *marker[] = {" ", "\x1b[32m+\x1b[0m", "\x1b[33m~\x1b[0m",
+                                 "\x1b[31m-\x1b[0m", "\x1b[31m_\x1b[0m"};
+  const char *m = marker[diff_mark(filerow)];
+  buffer_append(b, m, strlen(m));
+}
 
-      char *c = &E.r[filerow].render[E.coloff];
-      unsigned char *hl = &E.r[filerow].hl[E.coloff];
+// draws len render columns of filerow starting at column from; returns how
+// many there were
+int draw_line(struct buffer *b, int filerow, int from, int len) {
+  if (len > E.r[filerow].rsize - from)
+    len = E.r[filerow].rsize - from;
+  if (len < 0)
+    len = 0;
 
-      int current_color = -1;
+  char *c = E.r[filerow].render;
+  unsigned char *hl = E.r[filerow].hl;
 
-      int j;
-      int end_x;
-      int start_x;
-      struct cursor start;
-      struct cursor end;
-      start = E.select->initial.y < E.select->final.y ? E.select->initial
-                                                      : E.select->final;
-      end = E.select->initial.y < E.select->final.y ? E.select->final
-                                                    : E.select->initial;
-      for (j = 0; j < len; j++) {
-        if (E.mode == VISUAL && filerow >= start.y && filerow <= end.y) {
-          start_x = (filerow == E.select->initial.y) ? E.select->initial.x : 0;
-          end_x = (filerow == E.select->final.y) ? E.select->final.x
-                                                 : E.r[filerow].size;
-
-          if (j >= start_x && j < end_x) {
-            // Apply inverse video highlight
-            buffer_append(b, "\x1b[7m", 4);
-          }
+  int current_color = -1;
 
-          // strcat(E.select->text, &c[j]);
-        }
-        if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          buffer_append(b, "\x1b[7m", 4);
-          buffer_append(b, &sym, 1);
-          buffer_append(b, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            buffer_append(b, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            buffer_append(b, "\x1b[0m", 4);
-            current_color = -1;
-          }
-          buffer_append(b, &c[j], 1);
-        } else {
-          int color = syntcol(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            buffer_append(b, buf, clen);
-          }
-          buffer_append(b, &c[j], 1);
-        }
-
-        if (E.mode == VISUAL && filerow >= start.y && filerow <= end.y) {
-          if (j == end_x - 1) {
-            buffer_append(b, "\x1b[0m", 4);
-          }
-        }
+  int j;
+  struct cursor start;
+  struct cursor end;
+  start = E.select->initial.y < E.select->final.y ? E.select->initial
+                                                  : E.select->final;
+  end = E.select->initial.y < E.select->final.y ? E.select->final
+                                                : E.select->initial;
+  // the part of this row the selection covers, if it reaches it
+  int selected = E.mode == VISUAL && filerow >= start.y && filerow <= end.y;
+  int start_x = 0, end_x = 0;
+  if (selected) {
+    start_x = (filerow == E.select->initial.y) ? E.select->initial.x : 0;
+    end_x = (filerow == E.select->final.y) ? E.select->final.x
+                                           : E.r[filerow].size;
+  }
+  for (j = from; j < from + len; j++) {
+    int mark = filerow == E.bracket.y && j == E.bracket.x;
+    if (mark)
+      buffer_append(b, "\x1b[7m", 4);
+    if (selected && j >= start_x && j < end_x) {
+      // Apply inverse video highlight
+      buffer_append(b, "\x1b[7m", 4);
+    }
+    if (iscntrl(c[j])) {
+      char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+      buffer_append(b, "\x1b[7m", 4);
+      buffer_append(b, &sym, 1);
+      buffer_append(b, "\x1b[m", 3);
+      if (current_color != -1) {
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+        buffer_append(b, buf, clen);
+      }
+    } else if (hl[j] == HL_NORMAL) {
+      if (current_color != -1) {
+        buffer_append(b, "\x1b[0m", 4);
+        current_color = -1;
+      }
+      buffer_append(b, &c[j], 1);
+    } else {
+      int color = syntcol(hl[j]);
+      if (color != current_color) {
+        current_color = color;
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+        buffer_append(b, buf, clen);
       }
+      buffer_append(b, &c[j], 1);
+    }
+
+    if (selected && j == end_x - 1) {
       buffer_append(b, "\x1b[0m", 4);
     }
-    // clearing line by line instead of the whole screen
-    buffer_append(b, "\x1b[K", 3);
-    buffer_append(b, "\r\n", 2);
+    if (mark)
+      buffer_append(b, "\x1b[27m", 5);
   }
+  buffer_append(b, "\x1b[0m", 4);
+  return len;
 }
 
-void paste_clipboard(clipboard_c *cb) {
-  char *text = clipboard_text(cb);
-  if (text == NULL)
+// after the first row of a closed fold, say how much it hides
+void draw_fold_marker(struct buffer *b, int filerow, int room) {
+  int k = fold_range(filerow + 1);
+  if (k < 0 || E.folds.hidden[k].start != filerow + 1)
     return;
-  int i = 0;
-  while (text[i] != '\0') {
-    insert_char(text[i]);
-    i++;
-  }
-  free(text);
+  char marker[48];
+  int len = snprintf(marker, sizeof(marker), " ··· %d lines",
+                     E.folds.hidden[k].end - filerow);
+  // the dots are 3 bytes each but one column
+  if (len - 6 > room)
+    return;
+  buffer_append(b, "\x1b[30m", 5);
+  buffer_append(b, marker, len);
+  buffer_append(b, "\x1b[0m", 4);
 }
 
-char *get_text_in_selection() {
-  struct cursor start = E.select->initial.y < E.select->final.y
-                            ? E.select->initial
-                            : E.select->final;
-  struct cursor end = E.select->initial.y < E.select->final.y
-                          ? E.select->final
-                          : E.select->initial;
-  // Check that the start and end cursors are within the bounds of the E.r array
-  if (start.y < 0 || start.y >= E.nrows || end.y < 0 || end.y >= E.nrows) {
-    return NULL;
-  }
-
-  int len = 0;
-  if (start.y == end.y) {
-    len = end.x - start.x;
-  } else {
-    row *r = &E.r[start.y];
-    len = r->size - start.x;
-    for (int i = start.y + 1; i < end.y; i++) {
-      len += E.r[i].size + 1; // +1 for newline character
-    }
-    len += end.x;
-  }
-
-  char *selected_text = malloc(len + 1); // +1 for null terminator
-  if (selected_text == NULL) {
-    return NULL;
-  }
-
-  int pos = 0;
-  if (start.y == end.y) {
-    strncpy(selected_text, &E.r[start.y].chars[start.x], len);
-    pos = len;
-  } else {
-    row *r = &E.r[start.y];
-    strncpy(selected_text, &r->chars[start.x], r->size - start.x);
-    pos = r->size - start.x;
-    for (int i = start.y + 1; i < end.y; i++) {
-      selected_text[pos++] = '\n';
-      strncpy(selected_text + pos, E.r[i].chars, E.r[i].size);
-      pos += E.r[i].size;
-    }
-    strncpy(selected_text + pos, E.r[end.y].chars, end.x);
-    pos += end.x;
+void draw_rows(struct buffer *b) {
+  struct frame *fr = &E.frame;
+  if (E.hex.on) {
+    hex_draw(b);
+    fr->valid = 0;
+    return;
   }
+  struct view now;
+  memset(&now, 0, sizeof(now));
+  now.rowoff = E.rowoff;
+  now.coloff = E.coloff;
+  now.sub = E.wrap.on ? E.wrap.sub : 0;
+  now.wrap = E.wrap.on;
+  now.width = E.wrap.width;
+  now.rows = E.ws.rows;
+  now.columns = E.ws.columns;
+  now.gutter = findn(E.nrows);
+  now.empty = E.nrows == 0;
+  now.folds = E.folds.built;
+  now.diff = E.diff.built;
+  now.mode = E.mode;
+  now.syntax = E.syntax;
+
+  // only the rows the change feed reports, plus the ones the cursor and the
+  // bracket highlight left or moved to, need drawing again. the selection is
+  // not tracked, so visual mode always draws everything
+  int lo = 0, hi = INT_MAX;
+  int all = !fr->valid || E.mode == VISUAL || E.nrows == 0 ||
+            memcmp(&now, &fr->view, sizeof(now)) != 0 ||
+            changes_since(fr->version, &lo, &hi) == -1;
+  if (!all && fr->version == E.changes.version)
+    lo = INT_MAX, hi = -1;
+  // a changed row moves the lines of the ones below it when they wrap
+  if (!all && E.wrap.on && hi >= lo)
+    hi = INT_MAX;
+  int marks[4] = {fr->cur_y, fr->bracket_y, E.cur.y, E.bracket.y};
 
-  selected_text[pos] = '\0';
-
-  for (int i = 0; i < pos; i++) {
-    if (selected_text[i] == '\n') {
-      selected_text[i] = '\\';
-      selected_text[i + 1] = 'n';
-      memmove(selected_text + i + 2, selected_text + i + 1, pos - i);
-      pos++;
+  int y;
+  // with wrapping on, filerow only moves on once all of its lines are out
+  int filerow = E.rowoff;
+  int sub = E.wrap.on ? E.wrap.sub : 0;
+  for (y = 0; y < E.ws.rows; y++) {
+    int draw = all || (filerow >= lo && filerow <= hi);
+    for (int m = 0; m < 4 && !draw; m++)
+      draw = filerow == marks[m];
+    if (!draw) {
+      if (filerow < E.nrows && (!E.wrap.on || ++sub >= E.r[filerow].vlines)) {
+        filerow = fold_next(filerow);
+        sub = 0;
+      }
+      buffer_append(b, "\r\n", 2);
+      continue;
     }
-  }
-
-  return selected_text;
-}
-
-void delete_selection(clipboard_c *cb) {
-  // clipboard_set_text(cb, get_text_in_selection());
-  struct cursor start = E.select->initial.y < E.select->final.y
-                            ? E.select->initial
-                            : E.select->final;
-  struct cursor end = E.select->initial.y < E.select->final.y
-                          ? E.select->final
-                          : E.select->initial;
-  if (start.y == end.y) {
-    row *r = &E.r[start.y];
-    // Remove the selectedp text
-    // go through the row and remove the selected Text without memmove
-    if (start.x < end.x) {
-      memmove(&r->chars[start.x], &r->chars[end.x], r->size - end.x + 1);
-      r->size -= (end.x - start.x);
-      update_row(r);
+    if (filerow >= E.nrows) {
+      if (E.nrows == 0 && y == E.ws.rows / 2) {
+        for (size_t i = 0;
+             i < sizeof(dashboard_lines) / sizeof(dashboard_lines[0]); i++) {
+          dashboard_insert_line(dashboard_lines[i], b);
+        }
+      }
+    } else if (E.wrap.on) {
+      draw_gutter(b, filerow, sub == 0);
+      int used = draw_line(b, filerow, sub * E.wrap.width, E.wrap.width);
+      if (++sub >= E.r[filerow].vlines) {
+        draw_fold_marker(b, filerow, E.wrap.width - used);
+        filerow = fold_next(filerow);
+        sub = 0;
+      }
     } else {
-      memmove(&r->chars[end.x], &r->chars[start.x], r->size - start.x + 1);
-      r->size -= (start.x - end.x);
-      update_row(r);
-    }
-  } else {
-    row *r = &E.r[start.y];
-    row *r2 = &E.r[end.y];
-
-    memmove(&r->chars[start.x], &r2->chars[end.x], r2->size - end.x + 1);
-    r->size = start.x + r2->size - end.x;
-    memmove(&r2->chars[0], &r2->chars[end.x], r2->size - end.x + 1);
-    r2->size -= end.x;
-    for (int i = start.y + 1; i <= end.y; i++) {
-      del_row(start.y + 1);
+      draw_gutter(b, filerow, 1);
+      int used = draw_line(b, filerow, E.coloff, text_width());
+      draw_fold_marker(b, filerow, text_width() - used);
+      filerow = fold_next(filerow);
     }
-    update_row(r);
-    update_row(r2);
+    // clearing line by line instead of the whole screen
+    buffer_append(b, "\x1b[K", 3);
+    buffer_append(b, "\r\n", 2);
   }
-  E.cur = start;
-  E.mode = NORMAL;
+
+  fr->valid = 1;
+  fr->version = E.changes.version;
+  fr->cur_y = E.cur.y;
+  fr->bracket_y = E.bracket.y;
+  fr->view = now;
 }
 
 void enable_raw_mode() {
@@ -621,7 +1662,7 @@ void enable_raw_mode() {
      tcgetattr() -> gets all the current attributes of the standard input and
      saves them in raw
   */
-  if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1)
+  if (tcgetattr(E.ttyfd, &E.orig_termios) == -1)
     die("tcgetattr");
 
   atexit(disable_raw_mode);
@@ -647,15 +1688,23 @@ void enable_raw_mode() {
   raw.c_cc[VTIME] = 1;
 
   // now setting the edited attributes
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
+  if (tcsetattr(E.ttyfd, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // have pasted text wrapped in ESC[200~ ... ESC[201~, see read_paste
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 void refresh_screen() {
 
   scroll();
+  if (bracket_match(E.cur.y, E.rx, &E.bracket) == -1)
+    E.bracket.y = -1;
 
   struct buffer buf = BUFFER_INIT;
+  // the terminal holds the frame back until it is complete (synchronized
+  // output, DEC mode 2026) so a half drawn screen never shows
+  buffer_append(&buf, "\x1b[?2026h", 8);
   // \xib -> escape character
   // URL - https://vt100.net/docs/vt100-ug/chapter3.html#ED
   buffer_append(&buf, "\x1b[?25l", 6);
@@ -670,35 +1719,171 @@ void refresh_screen() {
   message_bar(&buf);
 
   char bu[32];
-  snprintf(bu, sizeof(bu), "\x1b[%d;%dH", E.cur.y - E.rowoff + 2,
-           E.rx - E.coloff + findn(E.nrows) + 2);
+  if (E.hex.on) {
+    int y, x;
+    hex_cursor(&y, &x);
+    snprintf(bu, sizeof(bu), "\x1b[%d;%dH", y, x);
+  } else if (E.wrap.on)
+    snprintf(bu, sizeof(bu), "\x1b[%d;%dH", E.wrap.cy + 2,
+             E.wrap.cx + findn(E.nrows) + 2);
+  else
+    snprintf(bu, sizeof(bu), "\x1b[%d;%dH",
+             fold_count(E.cur.y) - fold_count(E.rowoff) + 2,
+             E.rx - E.coloff + findn(E.nrows) + 2);
   buffer_append(&buf, bu, strlen(bu));
 
   buffer_append(&buf, "\x1b[?25h", 6);
+  buffer_append(&buf, "\x1b[?2026l", 8);
 
-  write(STDOUT_FILENO, buf.b, buf.len);
+  mem_count(MEM_FRAME, buf.len);
+  term_write(buf.b, buf.len);
   buffer_free(&buf);
+  mem_count(MEM_FRAME, -buf.len);
+}
+
+// one byte from the keyboard, taking what read_paste read too far first
+int tty_read(char *c) {
+  struct input *in = &E.input;
+  if (in->ahead_at < in->ahead.len) {
+    *c = in->ahead.b[in->ahead_at++];
+    return 1;
+  }
+  return read(E.ttyfd, c, 1);
+}
+
+/* with bracketed paste on the terminal sends pasted text between ESC[200~
+ * and ESC[201~. it is read here in large chunks straight into
+ * E.input.paste rather than key by key, with the line ends the terminal
+ * turned into \r made \n again. */
+int read_paste() {
+  static const char end[] = "\x1b[201~";
+  struct input *in = &E.input;
+  in->paste.len = 0;
+  char chunk[1 << 16];
+  int at = -1;
+  // a paste whose end never comes is given up on after a second of silence
+  for (int quiet = 0; at == -1 && quiet < 10;) {
+    int n = read(E.ttyfd, chunk, sizeof(chunk));
+    if (n == -1 && errno != EAGAIN && !E.host.on)
+      die("read");
+    if (n <= 0) {
+      quiet++;
+      continue;
+    }
+    quiet = 0;
+    int from = in->paste.len > 5 ? in->paste.len - 5 : 0;
+    buffer_append(&in->paste, chunk, n);
+    char *hit = memmem(in->paste.b + from, in->paste.len - from, end, 6);
+    if (hit)
+      at = hit - in->paste.b;
+  }
+  if (at != -1) {
+    in->ahead.len = in->ahead_at = 0;
+    buffer_append(&in->ahead, in->paste.b + at + 6, in->paste.len - at - 6);
+    in->paste.len = at;
+  }
+  int w = 0;
+  for (int i = 0; i < in->paste.len; i++) {
+    char ch = in->paste.b[i];
+    if (ch == '\r') {
+      ch = '\n';
+      if (i + 1 < in->paste.len && in->paste.b[i + 1] == '\n')
+        i++;
+    }
+    in->paste.b[w++] = ch;
+  }
+  in->paste.len = w;
+  return PASTE;
+}
+
+void wake_drain() {
+  char drain[64];
+  while (read(E.wake[0], drain, sizeof(drain)) > 0)
+    ;
+}
+
+// the rest of an ESC[8;rows;colst
+void term_resize() {
+  int v[2] = {0, 0}, i = 0;
+  char c;
+  while (tty_read(&c) == 1 && c != 't') {
+    if (c == ';' && i == 0)
+      i++;
+    else if (isdigit(c) && v[i] < 10000)
+      v[i] = v[i] * 10 + c - '0';
+    else
+      return;
+  }
+  if (v[0] < 4 || v[1] < 10)
+    return;
+  E.ws.rows = v[0] - 3;
+  E.ws.columns = v[1];
+  E.wrap.stale = 1;
+  E.frame.valid = 0;
+  refresh_screen();
 }
 
 int read_key() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+  int busy = 0;
+  while (1) {
+    if (E.input.ahead_at < E.input.ahead.len) {
+      tty_read(&c);
+      break;
+    }
+    int ready;
+    // while background work is queued up only peek at the keyboard
+    if (E.host.on) {
+      ready = host_wait(busy ? 0 : 100);
+    } else {
+      struct pollfd pfd[2] = {{E.ttyfd, POLLIN, 0}, {E.wake[0], POLLIN, 0}};
+      poll(pfd, 2, busy ? 0 : 100);
+      ready = pfd[0].revents & (POLLIN | POLLHUP);
+      if (pfd[1].revents & POLLIN)
+        wake_drain();
+    }
+    if (ready) {
+      nread = read(E.ttyfd, &c, 1);
+      if (nread == 1)
+        break;
+      // a terminal of the daemon's that went away
+      if (E.host.on && (nread == 0 || errno != EAGAIN))
+        host_detach(E.ttyfd);
+      else if (nread == -1 && errno != EAGAIN)
+        die("read");
+    }
+    int idle = editor_idle();
+    if (idle & IDLE_REDRAW)
+      refresh_screen();
+    busy = idle & IDLE_BUSY;
   }
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
+    if (tty_read(&seq[0]) != 1)
       return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
+    if (tty_read(&seq[1]) != 1)
       return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
+        if (tty_read(&seq[2]) != 1)
+          return '\x1b';
+        // ESC[8;rows;colst, the size of a terminal attached to the daemon
+        if (seq[1] == '8' && seq[2] == ';') {
+          term_resize();
+          return read_key();
+        }
+        // ESC[200~ starts a bracketed paste
+        if (seq[1] == '2' && seq[2] == '0') {
+          char tail[2];
+          if (tty_read(&tail[0]) != 1 || tty_read(&tail[1]) != 1)
+            return '\x1b';
+          if (tail[0] == '0' && tail[1] == '~')
+            return read_paste();
           return '\x1b';
+        }
         if (seq[2] == '~') {
           switch (seq[1]) {
           case '5':
@@ -751,7 +1936,7 @@ int cursor_position(int *rows, int *cols) {
 
   printf("\r\n");
   char c;
-  while (read(STDIN_FILENO, &c, 1) == 1) {
+  while (read(E.ttyfd, &c, 1) == 1) {
     if (iscntrl(c)) {
       printf("%d\r\n", c);
     } else {
@@ -784,13 +1969,208 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void update_syntax(row *r) {
-  r->hl = realloc(r->hl, r->rsize);
-  memset(r->hl, HL_NORMAL, r->rsize);
+// long rows
+
+/* a row of at least LONG_ROW columns (minified code, a JSON dump) keeps its
+ * text in one piece but is looked at in chunks of about CHUNK columns. each
+ * chunk remembers the highlighter state at its start and its own bracket
+ * summaries, so an edit only rehighlights from a little before it up to the
+ * first chunk whose state comes out unchanged, and bracket matching skips
+ * whole chunks like it skips rows. long rows have no tabs; a row with one is
+ * treated like any other. */
+#define LONG_ROW (64 * 1024)
+#define CHUNK 4096
+#define CHUNK_LOOKBACK 64 // longer than any token an edit could join up with
+
+// the chunk of r holding column at, with its first column in *start
+int chunk_find(row *r, int at, int *start) {
+  int s = 0, k = 0;
+  while (k < r->nchunks - 1 && s + r->chunks[k].len <= at)
+    s += r->chunks[k++].len;
+  *start = s;
+  return k;
+}
+
+// notes down st as the state chunk k, starting at column start, begins with
+void chunk_mark(row *r, int k, int start, struct hl_state *st) {
+  struct hl_state *c = &r->chunks[k].st;
+  *c = *st;
+  c->i -= start;
+  c->number = st->i > 0 && r->hl[st->i - 1] == HL_NUMBER;
+}
+
+// cuts r into chunks if it is long enough, or drops them if it is not; the
+// states and bracket summaries are filled in by syntax_row
+void row_chunks(row *r) {
+  if (r->rsize < LONG_ROW || memchr(r->chars, '\t', r->size)) {
+    mem_free(MEM_META, r->chunks);
+    r->chunks = NULL;
+    r->nchunks = 0;
+    return;
+  }
+  int n = (r->rsize + CHUNK - 1) / CHUNK;
+  if (n != r->nchunks || r->chunks == NULL) {
+    mem_free(MEM_META, r->chunks);
+    r->chunks = mem_malloc(MEM_META, sizeof(struct row_chunk) * n);
+    r->nchunks = n;
+  }
+  for (int k = 0; k < n; k++) {
+    r->chunks[k].len = k < n - 1 ? CHUNK : r->rsize - k * CHUNK;
+    memset(&r->chunks[k].st, 0, sizeof(struct hl_state));
+  }
+}
+
+// brackets
+
+/* every row keeps, per bracket type, how much it changes the nesting depth
+ * (delta) and the lowest depth it dips to on the way (fmin, at most 0). the
+ * highest depth seen coming from the end is then delta - fmin. finding a
+ * match only scans the characters of the row it starts in and the row it
+ * ends in; every row in between is skipped by its summary. brackets in
+ * strings and comments, going by the highlighting, don't count. */
+const char *brackets = "([{)]}";
+
+int bracket_type(row *r, int j, int *open) {
+  char c = r->render[j];
+  char *p = c ? strchr(brackets, c) : NULL;
+  if (p == NULL || r->hl[j] == HL_STRING || r->hl[j] == HL_COMMENT ||
+      r->hl[j] == HL_MLCOMMENT)
+    return -1;
+  *open = p - brackets < 3;
+  return (p - brackets) % 3;
+}
+
+// the summaries of columns from..to - 1 of r
+void span_brackets(row *r, int from, int to, struct bracket_sum *br) {
+  memset(br, 0, sizeof(struct bracket_sum) * 3);
+  for (int j = from; j < to; j++) {
+    int open;
+    int t = bracket_type(r, j, &open);
+    if (t == -1)
+      continue;
+    br[t].delta += open ? 1 : -1;
+    if (br[t].delta < br[t].fmin)
+      br[t].fmin = br[t].delta;
+  }
+}
+
+// a long row's summary is put together from those of its chunks; those of
+// chunks first..last are worked out again
+void row_brackets(row *r, int first, int last) {
+  if (r->chunks == NULL) {
+    span_brackets(r, 0, r->rsize, r->br);
+    return;
+  }
+  int start = 0;
+  memset(r->br, 0, sizeof(r->br));
+  for (int k = 0; k < r->nchunks; k++) {
+    if (k >= first && k <= last)
+      span_brackets(r, start, start + r->chunks[k].len, r->chunks[k].br);
+    start += r->chunks[k].len;
+    for (int t = 0; t < 3; t++) {
+      struct bracket_sum *c = &r->chunks[k].br[t];
+      if (r->br[t].delta + c->fmin < r->br[t].fmin)
+        r->br[t].fmin = r->br[t].delta + c->fmin;
+      r->br[t].delta += c->delta;
+    }
+  }
+}
+
+// walks r from column j in direction dir until *need brackets of type t are
+// balanced; returns the column, or -1 with *need updated. the chunks of a
+// long row in between are skipped by their summaries like rows are.
+int bracket_scan(row *r, int t, int j, int dir, int *need) {
+  int start = 0, k = 0;
+  if (r->chunks && j >= 0 && j < r->rsize)
+    k = chunk_find(r, j, &start);
+  while (j >= 0 && j < r->rsize) {
+    int from = r->chunks ? start : 0;
+    int to = r->chunks ? start + r->chunks[k].len : r->rsize;
+    for (; j >= from && j < to; j += dir) {
+      int open;
+      if (bracket_type(r, j, &open) != t)
+        continue;
+      *need += (open == (dir == 1)) ? 1 : -1;
+      if (*need == 0)
+        return j;
+    }
+    if (r->chunks == NULL)
+      break;
+    for (;;) {
+      if (dir == 1)
+        start += r->chunks[k++].len;
+      else if (--k >= 0)
+        start -= r->chunks[k].len;
+      if (k < 0 || k >= r->nchunks)
+        return -1;
+      struct bracket_sum *s = &r->chunks[k].br[t];
+      if (dir == 1 ? *need + s->fmin > 0 : *need - (s->delta - s->fmin) > 0)
+        *need += dir * s->delta;
+      else
+        break;
+    }
+    j = dir == 1 ? start : start + r->chunks[k].len - 1;
+  }
+  return -1;
+}
+
+// the bracket matching the one at render column x of row y; 0 if found
+int bracket_match(int y, int x, struct cursor *match) {
+  if (y >= E.nrows || x >= E.r[y].rsize)
+    return -1;
+  int open;
+  int t = bracket_type(&E.r[y], x, &open);
+  if (t == -1)
+    return -1;
+  int dir = open ? 1 : -1;
+  int need = 1;
+  int at = bracket_scan(&E.r[y], t, x + dir, dir, &need);
+  while (at == -1) {
+    y += dir;
+    if (y < 0 || y >= E.nrows)
+      return -1;
+    struct bracket_sum *s = &E.r[y].br[t];
+    if (dir == 1 && need + s->fmin > 0) {
+      need += s->delta;
+    } else if (dir == -1 && need - (s->delta - s->fmin) > 0) {
+      need -= s->delta;
+    } else {
+      at = bracket_scan(&E.r[y], t, dir == 1 ? 0 : E.r[y].rsize - 1, dir,
+                        &need);
+    }
+  }
+  match->y = y;
+  match->x = at;
+  return 0;
+}
 
-  if (E.syntax == NULL)
+// %: from the first bracket at or after the cursor to its match
+void bracket_jump() {
+  if (E.cur.y >= E.nrows)
     return;
+  row *r = &E.r[E.cur.y];
+  struct cursor m;
+  for (int j = ctrx(r, E.cur.x); j < r->rsize; j++) {
+    int open;
+    if (bracket_type(r, j, &open) == -1)
+      continue;
+    if (bracket_match(E.cur.y, j, &m) == 0) {
+      E.cur.y = m.y;
+      E.cur.x = rtcx(&E.r[m.y], m.x);
+    }
+    return;
+  }
+}
 
+// runs the highlighter on from st up to column end of r; tokens may run
+// over end, the state says where it has to go on from
+void hl_scan(row *r, struct hl_state *st, int end) {
+  if (st->done) {
+    if (st->i < end)
+      memset(&r->hl[st->i], HL_COMMENT, end - st->i);
+    st->i = end > st->i ? end : st->i;
+    return;
+  }
   char **keywords = E.syntax->keywords;
   char *scs = E.syntax->singleline_comment_start;
   char *mcs = E.syntax->multiline_comment_start;
@@ -800,18 +2180,19 @@ void update_syntax(row *r) {
   int mcs_len = mcs ? strlen(mcs) : 0;
   int mce_len = mce ? strlen(mce) : 0;
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (r->idx > 0 && E.r[r->idx - 1].hl_open_comment);
-
-  int i = 0;
-  while (i < r->rsize) {
+  int in_comment = st->in_comment;
+  int prev_sep = st->prev_sep;
+  int in_string = st->in_string;
+  int i = st->i;
+  while (i < end) {
     char c = r->render[i];
     unsigned char prev_hl = (i > 0) ? r->hl[i - 1] : HL_NORMAL;
 
     if (scs_len && !in_string && !in_comment) {
       if (!strncmp(&r->render[i], scs, scs_len)) {
-        memset(&r->hl[i], HL_COMMENT, r->rsize - i);
+        memset(&r->hl[i], HL_COMMENT, end - i);
+        st->done = 1;
+        i = end;
         break;
       }
     }
@@ -893,9 +2274,45 @@ void update_syntax(row *r) {
     prev_sep = is_separator(c);
     i++;
   }
-  int changed = (r->hl_open_comment != in_comment);
-  r->hl_open_comment = in_comment;
-  if (changed && r->idx + 1 < E.nrows)
+  st->i = i;
+  st->in_comment = in_comment;
+  st->in_string = in_string;
+  st->prev_sep = prev_sep;
+}
+
+// highlights one row given the comment state the previous row left open;
+// returns 1 if the state this row leaves open changed
+int syntax_row(row *r, int in_comment) {
+  r->hl = mem_realloc(MEM_HL, r->hl, r->rsize);
+  memset(r->hl, HL_NORMAL, r->rsize);
+  row_chunks(r);
+
+  if (E.syntax == NULL) {
+    row_brackets(r, 0, r->nchunks - 1);
+    return 0;
+  }
+
+  struct hl_state st = {0, in_comment, 0, 1, 0, 0};
+  if (r->chunks) {
+    int start = 0;
+    for (int k = 0; k < r->nchunks; k++) {
+      chunk_mark(r, k, start, &st);
+      hl_scan(r, &st, start + r->chunks[k].len);
+      start += r->chunks[k].len;
+    }
+  } else {
+    hl_scan(r, &st, r->rsize);
+  }
+  row_brackets(r, 0, r->nchunks - 1);
+  int changed = (r->hl_open_comment != st.in_comment);
+  r->hl_open_comment = st.in_comment;
+  return changed;
+}
+
+void update_syntax(row *r) {
+  change_note(CHANGE_ROWS, r->idx, r->idx);
+  int in_comment = (r->idx > 0 && E.r[r->idx - 1].hl_open_comment);
+  if (syntax_row(r, in_comment) && r->idx + 1 < E.nrows)
     update_syntax(&E.r[r->idx + 1]);
 }
 
@@ -913,13 +2330,39 @@ void init_editor() {
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
-  E.reg = 0;
+  E.regname = 0;
+  E.count = 0;
+  E.journal.fd = -1;
+  E.journal.path = NULL;
+  E.hex.fd = -1;
+  E.journal.pending = (struct buffer)BUFFER_INIT;
+  E.journal.replaying = 0;
+  E.follow.ifd = -1;
+  E.follow.fd = -1;
+  E.follow.offset = 0;
+  E.follow.open_line = 0;
+  E.stream.active = 0;
+  E.compress = 0;
+  if (pipe2(E.wake, O_NONBLOCK | O_CLOEXEC) == -1)
+    die("pipe");
+  change_subscribe(diff_changed);
 
   E.select = malloc(sizeof(struct select));
 
-  if (window_size(&E.ws.rows, &E.ws.columns) == -1)
+#ifdef POUND_BENCH
+  // no terminal to ask, the benchmarks draw into a screen of this size
+  E.ws.rows = 50;
+  E.ws.columns = 160;
+#else
+  // the daemon's terminals tell their size once they attach
+  if (E.host.on) {
+    E.ws.rows = 24;
+    E.ws.columns = 80;
+  } else if (window_size(&E.ws.rows, &E.ws.columns) == -1) {
     die("window_size");
+  }
   E.ws.rows -= 3;
+#endif
 }
 
 char *start_prompt(char *prompt, void (*callback)(char *, int)) {
@@ -949,6 +2392,19 @@ char *start_prompt(char *prompt, void (*callback)(char *, int)) {
           callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE) {
+      // the first line of it, a prompt has no room for more
+      struct buffer *p = &E.input.paste;
+      for (int i = 0; i < p->len && p->b[i] != '\n'; i++) {
+        if (iscntrl((unsigned char)p->b[i]))
+          continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = p->b[i];
+      }
+      buf[buflen] = '\0';
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
@@ -970,25 +2426,25 @@ void move_cursor(int key) {
     if (E.cur.x >= 0) {
       E.cur.x--;
     } else if (E.cur.y > 0) {
-      E.cur.y--;
+      E.cur.y = fold_prev(E.cur.y);
       E.cur.x = E.r[E.cur.y].size;
     }
     break;
   case ARROW_DOWN:
-    if (E.cur.y < E.nrows - 1) {
-      E.cur.y++;
+    if (fold_next(E.cur.y) < E.nrows) {
+      E.cur.y = fold_next(E.cur.y);
     }
     break;
   case ARROW_UP:
     if (E.cur.y != 0) {
-      E.cur.y--;
+      E.cur.y = fold_prev(E.cur.y);
     }
     break;
   case ARROW_RIGHT:
     if (r && E.cur.x < r->size) {
       E.cur.x++;
-    } else if (r && E.cur.x == r->size && E.cur.y < E.nrows - 1) {
-      E.cur.y++;
+    } else if (r && E.cur.x == r->size && fold_next(E.cur.y) < E.nrows) {
+      E.cur.y = fold_next(E.cur.y);
       E.cur.x = 0;
     }
     break;
@@ -1001,15 +2457,203 @@ void move_cursor(int key) {
   }
 }
 
-void update_row(row *r) {
+void page_move(int key) {
+  if (E.wrap.on) {
+    wrap_page(key);
+    return;
+  }
+  int times = E.ws.rows;
+  while (times--)
+    move_cursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+}
+
+// worker threads
+
+int nthreads() {
+  static int n = 0;
+  if (n == 0) {
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+      n = 1;
+    if (n > 64)
+      n = 64;
+  }
+  return n;
+}
+
+struct parallel_job {
+  void (*fn)(void *ctx, int lo, int hi);
+  void *ctx;
+  int lo;
+  int hi;
+};
+
+void *parallel_worker(void *arg) {
+  struct parallel_job *job = arg;
+  job->fn(job->ctx, job->lo, job->hi);
+  return NULL;
+}
+
+/* runs fn over [0, n) split into one contiguous range per core and waits for
+ * all of them. inputs under min items just run inline. */
+#define PARALLEL_MIN 4096
+
+void parallel_for_min(int n, int min, void (*fn)(void *ctx, int lo, int hi),
+                      void *ctx) {
+  int t = nthreads();
+  if (n < min || t == 1) {
+    fn(ctx, 0, n);
+    return;
+  }
+  int step = (n + t - 1) / t;
+  pthread_t th[64];
+  struct parallel_job jobs[64];
+  int started = 0;
+  for (int lo = 0; lo < n; lo += step) {
+    struct parallel_job *job = &jobs[started];
+    job->fn = fn;
+    job->ctx = ctx;
+    job->lo = lo;
+    job->hi = lo + step < n ? lo + step : n;
+    if (pthread_create(&th[started], NULL, parallel_worker, job) != 0) {
+      fn(ctx, job->lo, job->hi);
+      continue;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(th[i], NULL);
+}
+
+void parallel_for(int n, void (*fn)(void *ctx, int lo, int hi), void *ctx) {
+  parallel_for_min(n, PARALLEL_MIN, fn, ctx);
+}
+
+// journal
+
+/* every edit is appended to .<file>.pswp as it happens, so a dead session can
+ * be replayed on the next open. records are batched in memory and written +
+ * fsynced at most once per JOURNAL_FLUSH_SECS, or sooner once
+ * JOURNAL_FLUSH_BYTES have piled up. */
+#define JOURNAL_MAGIC "POUNDJ1\n"
+#define JOURNAL_FLUSH_SECS 1
+#define JOURNAL_FLUSH_BYTES (64 * 1024)
+
+enum journal_op {
+  J_INSERT_ROW = 1, // row, payload = row text
+  J_DELETE_ROW,     // row
+  J_INSERT,         // row, col, payload = inserted bytes
+  J_DELETE,         // row, col, n bytes
+  J_APPEND,         // row, payload = appended bytes
+  J_SET_ROW,        // row, payload = new row text
+  J_DELETE_ROWS,    // row, n rows
+  J_SORT,           // row, n rows, col = SORT_* flags, see // sort
+};
+
+struct journal_header {
+  char magic[8];
+  int64_t size;
+  int64_t mtime;
+  int64_t ino;
+};
+
+struct journal_record {
+  uint32_t op;
+  uint32_t row;
+  uint32_t col;
+  uint32_t n;
+};
+
+int journal_has_payload(int op) {
+  return op == J_INSERT_ROW || op == J_INSERT || op == J_APPEND ||
+         op == J_SET_ROW;
+}
+
+char *journal_path(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  char *path = malloc(strlen(filename) + 7);
+  sprintf(path, "%.*s.%s.pswp", dirlen, filename, filename + dirlen);
+  return path;
+}
+
+void journal_flush() {
+  struct journal *j = &E.journal;
+  if (j->fd == -1 || j->pending.len == 0)
+    return;
+  if (write(j->fd, j->pending.b, j->pending.len) == j->pending.len)
+    fdatasync(j->fd);
+  else
+    status_message("Journal write failed: %s", strerror(errno));
+  j->pending.len = 0;
+  j->last_flush = time(NULL);
+}
+
+// the journal file is only created once the buffer is actually edited
+void journal_start() {
+  struct journal *j = &E.journal;
+  j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (j->fd == -1)
+    return;
+  struct journal_header h;
+  memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+  h.size = j->base.st_size;
+  h.mtime = j->base.st_mtime;
+  h.ino = j->base.st_ino;
+  if (write(j->fd, &h, sizeof(h)) != sizeof(h)) {
+    close(j->fd);
+    j->fd = -1;
+    return;
+  }
+  j->last_flush = time(NULL);
+}
+
+void journal_record(int op, int row, int col, int n, const char *s) {
+  struct journal *j = &E.journal;
+  j->edits++;
+  if (op == J_INSERT_ROW)
+    change_note(CHANGE_INSERT, row, row);
+  else if (op == J_DELETE_ROW)
+    change_note(CHANGE_DELETE, row, row);
+  else if (op == J_DELETE_ROWS)
+    change_note(CHANGE_DELETE, row, row + n - 1);
+  else if (op == J_SORT)
+    change_note(CHANGE_ROWS, row, row + n - 1);
+  else
+    change_note(CHANGE_ROWS, row, row);
+  if (j->path == NULL || j->replaying)
+    return;
+  if (j->fd == -1) {
+    journal_start();
+    if (j->fd == -1)
+      return;
+  }
+  struct journal_record rec = {op, row, col, n};
+  buffer_append(&j->pending, (char *)&rec, sizeof(rec));
+  if (journal_has_payload(op))
+    buffer_append(&j->pending, s, n);
+  if (j->pending.len >= JOURNAL_FLUSH_BYTES)
+    journal_flush();
+}
+
+void journal_tick() {
+  if (E.journal.pending.len &&
+      time(NULL) - E.journal.last_flush >= JOURNAL_FLUSH_SECS)
+    journal_flush();
+}
+
+// expands tabs into r->render; touches nothing but r, so it is safe to run
+// on worker threads for distinct rows
+void render_row(row *r) {
   int tabs = 0;
   int j;
+  r->hash = 0; // see // diff
   for (j = 0; j < r->size; j++)
     if (r->chars[j] == '\t')
       tabs++;
 
-  free(r->render);
-  r->render = malloc(r->size + tabs * (TAB_STOP - 1) + 1);
+  mem_free(MEM_RENDER, r->render);
+  r->render = mem_malloc(MEM_RENDER, r->size + tabs * (TAB_STOP - 1) + 1);
 
   int idx = 0;
 
@@ -1025,44 +2669,260 @@ void update_row(row *r) {
 
   r->render[idx] = '\0';
   r->rsize = idx;
+}
 
+void update_row(row *r) {
+  render_row(r);
   update_syntax(r);
+  wrap_update(r);
 }
 
-void append_row(int at, char *s, size_t len) {
+// update_row after del characters at column at were replaced by ins others.
+// a long row only has its chunks around the edit redone, see // long rows
+void update_row_at(row *r, int at, int del, int ins) {
+  if (r->chunks == NULL || r->size < LONG_ROW ||
+      memchr(&r->chars[at], '\t', ins)) {
+    update_row(r);
+    return;
+  }
+  // render is the text itself, the highlighting moves along with it
+  int old = r->rsize;
+  r->hash = 0;
+  if (ins > del) {
+    r->render = mem_realloc(MEM_RENDER, r->render, r->size + 1);
+    r->hl = mem_realloc(MEM_HL, r->hl, r->size);
+  }
+  memmove(&r->render[at + ins], &r->render[at + del], old - at - del + 1);
+  memcpy(&r->render[at], &r->chars[at], ins);
+  memmove(&r->hl[at + ins], &r->hl[at + del], old - at - del);
+  memset(&r->hl[at], HL_NORMAL, ins);
+  r->rsize = r->size;
+
+  // the chunks the edit touched become one, cut up again if it got too
+  // long or put together with the next one if it got too short
+  int first_col, k = chunk_find(r, at, &first_col);
+  int j = k, left = del, off = at - first_col;
+  for (;;) {
+    int n = r->chunks[j].len - off < left ? r->chunks[j].len - off : left;
+    r->chunks[j].len -= n;
+    left -= n;
+    off = 0;
+    if (left == 0)
+      break;
+    j++;
+  }
+  r->chunks[k].len += ins;
+  int len = 0;
+  for (int m = k; m <= j; m++)
+    len += r->chunks[m].len;
+  if (len < CHUNK / 4 && j + 1 < r->nchunks)
+    len += r->chunks[++j].len;
+  int pieces = len > 2 * CHUNK ? len / CHUNK : len > 0;
+  int tail = r->nchunks - j - 1;
+  int n = k + pieces + tail;
+  if (n > r->nchunks)
+    r->chunks =
+        mem_realloc(MEM_META, r->chunks, sizeof(struct row_chunk) * n);
+  struct hl_state first = r->chunks[k].st;
+  memmove(&r->chunks[k + pieces], &r->chunks[j + 1],
+          sizeof(struct row_chunk) * tail);
+  for (int m = 0; m < pieces; m++) {
+    r->chunks[k + m].len = m < pieces - 1 ? CHUNK : len - m * CHUNK;
+    r->chunks[k + m].st = first;
+    if (m > 0)
+      r->chunks[k + m].st.i = -1; // not known yet
+  }
+  r->nchunks = n;
+  int lo = k, hi = k + pieces - 1;
+
+  // rehighlight from a little before the edit until a chunk after the ones
+  // it touched starts in the state it did before
+  if (E.syntax) {
+    // no later than the first touched chunk, the ones cut from it have no
+    // state yet
+    int from = at - CHUNK_LOOKBACK;
+    if (from > first_col)
+      from = first_col;
+    int start, c = chunk_find(r, from > 0 ? from : 0, &start);
+    struct hl_state st = r->chunks[c].st;
+    st.i += start;
+    if (c == 0)
+      st = (struct hl_state){0, r->idx > 0 && E.r[r->idx - 1].hl_open_comment,
+                             0, 1, 0, 0};
+    lo = c < lo ? c : lo;
+    for (; c < r->nchunks; c++) {
+      struct hl_state was = r->chunks[c].st;
+      chunk_mark(r, c, start, &st);
+      if (c > hi && start >= at + ins &&
+          memcmp(&was, &r->chunks[c].st, sizeof(was)) == 0)
+        break;
+      int end = start + r->chunks[c].len;
+      if (st.i < end)
+        memset(&r->hl[st.i], HL_NORMAL, end - st.i);
+      hl_scan(r, &st, end);
+      start = end;
+    }
+    // a token running into the chunk it stopped at can change its brackets
+    hi = c < r->nchunks ? c : r->nchunks - 1;
+    if (c == r->nchunks && st.in_comment != r->hl_open_comment) {
+      r->hl_open_comment = st.in_comment;
+      if (r->idx + 1 < E.nrows)
+        update_syntax(&E.r[r->idx + 1]);
+    }
+  }
+  row_brackets(r, lo, hi);
+  change_note(CHANGE_ROWS, r->idx, r->idx);
+  wrap_update(r);
+}
 
-  if (at < 0 || at > E.nrows)
+// row text can be shared with yank registers, in which case refs counts its
+// owners. shared text is never changed in place: whoever edits a row calls
+// row_own first and gets a private copy if anyone else still holds it.
+void text_release(char *chars, int *refs) {
+  if (refs && --*refs > 0)
     return;
-  E.r = realloc(E.r, sizeof(row) * (E.nrows + 1));
-  memmove(&E.r[at + 1], &E.r[at], sizeof(row) * (E.nrows - at));
-  for (int j = at + 1; j <= E.nrows; j++)
-    E.r[j].idx++;
+  mem_free(MEM_META, refs);
+  mem_free(MEM_CHARS, chars);
+}
 
-  E.r[at].idx = at;
+// snapshots
+
+/* a snapshot of the rows (for a background save, the word index build) is a
+ * piece per row that a worker reads while editing goes on. a row shared with
+ * a register already has a count, and the snapshot takes a reference like
+ * any other owner. giving every other row a count would be an allocation
+ * per row, so instead a row remembers the generation its text became its
+ * own in, and a snapshot covers all text owned in or before the generation
+ * it was taken in. a row whose text is covered copies it before changing it
+ * (row_own), and covered text a row lets go of is retired: kept on a list
+ * until no snapshot covers it any more. */
+int snap_covers(unsigned long gen) {
+  for (int i = 0; i < E.snaps.n; i++)
+    if (gen <= E.snaps.live[i])
+      return 1;
+  return 0;
+}
 
-  E.r[at].size = len;
-  E.r[at].chars = malloc(len + 1);
-  memcpy(E.r[at].chars, s, len);
-  E.r[at].chars[len] = '\0';
+void snap_retire(char *chars, int *refs, unsigned long gen) {
+  struct snaps *s = &E.snaps;
+  if (s->nold == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->old = realloc(s->old, sizeof(struct retired) * s->cap);
+  }
+  s->old[s->nold++] = (struct retired){chars, refs, gen};
+}
 
-  E.r[at].rsize = 0;
-  E.r[at].render = NULL;
-  E.r[at].hl = NULL;
-  E.r[at].hl_open_comment = 0;
-  update_row(&E.r[at]);
+// text_release for the text a row owned since gen
+void text_retire(char *chars, int *refs, unsigned long gen) {
+  if (refs == NULL && snap_covers(gen))
+    snap_retire(chars, refs, gen);
+  else
+    text_release(chars, refs);
+}
 
-  E.nrows++;
+void row_own(row *r) {
+  if (r->refs == NULL) {
+    if (!snap_covers(r->gen))
+      return;
+    char *copy = mem_malloc(MEM_CHARS, r->size + 1);
+    memcpy(copy, r->chars, r->size + 1);
+    snap_retire(r->chars, NULL, r->gen);
+    r->chars = copy;
+  } else if (*r->refs > 1) {
+    char *copy = mem_malloc(MEM_CHARS, r->size + 1);
+    memcpy(copy, r->chars, r->size + 1);
+    (*r->refs)--;
+    r->chars = copy;
+  } else {
+    mem_free(MEM_META, r->refs);
+  }
+  r->refs = NULL;
+  r->gen = E.snaps.gen;
+}
+
+// fills p with a piece per row; the generation returned is handed back to
+// snap_release along with them once the snapshot has been read
+unsigned long snap_take(struct piece *p) {
+  struct snaps *s = &E.snaps;
+  unsigned long gen = s->gen++;
+  s->live[s->n++] = gen;
+  for (int i = 0; i < E.nrows; i++) {
+    row *r = &E.r[i];
+    if (r->refs)
+      (*r->refs)++;
+    p[i] = (struct piece){r->chars, r->refs, 0, r->size};
+  }
+  return gen;
+}
+
+void snap_release(struct piece *p, int n, unsigned long gen) {
+  struct snaps *s = &E.snaps;
+  for (int i = 0; i < n; i++)
+    if (p[i].refs)
+      text_release(p[i].chars, p[i].refs);
+  for (int i = 0; i < s->n; i++)
+    if (s->live[i] == gen) {
+      s->live[i] = s->live[--s->n];
+      break;
+    }
+  int k = 0;
+  for (int i = 0; i < s->nold; i++) {
+    if (snap_covers(s->old[i].gen))
+      s->old[k++] = s->old[i];
+    else
+      text_release(s->old[i].chars, s->old[i].refs);
+  }
+  s->nold = k;
+}
+
+void append_row(int at, char *s, size_t len) {
+
+  if (at < 0 || at > E.nrows)
+    return;
+  journal_record(J_INSERT_ROW, at, 0, len, s);
+  E.r = mem_realloc(MEM_ROWS, E.r, sizeof(row) * (E.nrows + 1));
+  memmove(&E.r[at + 1], &E.r[at], sizeof(row) * (E.nrows - at));
+  for (int j = at + 1; j <= E.nrows; j++)
+    E.r[j].idx++;
+
+  E.r[at].idx = at;
+
+  E.r[at].size = len;
+  E.r[at].chars = mem_malloc(MEM_CHARS, len + 1);
+  memcpy(E.r[at].chars, s, len);
+  E.r[at].chars[len] = '\0';
+
+  E.r[at].rsize = 0;
+  E.r[at].render = NULL;
+  E.r[at].hl = NULL;
+  E.r[at].hl_open_comment = 0;
+  E.r[at].chunks = NULL;
+  E.r[at].refs = NULL;
+  E.r[at].gen = E.snaps.gen;
+  E.r[at].words = (struct word_row){0, NULL};
+  update_row(&E.r[at]);
+
+  E.nrows++;
   E.dirty++;
+  wrap_moved(at);
+  fold_shift(at, 1);
 }
 
-void insert_char_row(row *r, int at, int c) {
+void row_insert(row *r, int at, const char *s, int len) {
   if (at < 0 || at > r->size)
     at = r->size;
-  r->chars = realloc(r->chars, r->size + 2);
-  memmove(&r->chars[at + 1], &r->chars[at], r->size - at + 1);
-  r->size++;
-  r->chars[at] = c;
-  update_row(r);
+  journal_record(J_INSERT, r - E.r, at, len, s);
+  row_own(r);
+  r->chars = mem_realloc(MEM_CHARS, r->chars, r->size + len + 1);
+  memmove(&r->chars[at + len], &r->chars[at], r->size - at + 1);
+  memcpy(&r->chars[at], s, len);
+  r->size += len;
+  update_row_at(r, at, 0, len);
+}
+
+void insert_char_row(row *r, int at, int c) {
+  char ch = c;
+  row_insert(r, at, &ch, 1);
 }
 
 void insert_new_line() {
@@ -1072,9 +2932,7 @@ void insert_new_line() {
     row *r = &E.r[E.cur.y];
     append_row(E.cur.y + 1, &r->chars[E.cur.x], r->size - E.cur.x);
     r = &E.r[E.cur.y];
-    r->size = E.cur.x;
-    r->chars[r->size] = '\0';
-    update_row(r);
+    row_del_range(r, E.cur.x, r->size - E.cur.x);
 
     E.cur.y++;
     // Auto-indenting
@@ -1096,28 +2954,109 @@ void insert_new_line() {
   }
 }
 
-void row_del_char(row *r, int at) {
-  if (at < 0 || at >= r->size)
+void row_del_range(row *r, int at, int n) {
+  if (at < 0 || at >= r->size || n <= 0)
     return;
-  memmove(&r->chars[at], &r->chars[at + 1], r->size - at);
-  r->size--;
+  if (n > r->size - at)
+    n = r->size - at;
+  journal_record(J_DELETE, r - E.r, at, n, NULL);
+  row_own(r);
+  memmove(&r->chars[at], &r->chars[at + n], r->size - at - n + 1);
+  r->size -= n;
+  update_row_at(r, at, n, 0);
+  E.dirty++;
+}
+
+void row_del_char(row *r, int at) { row_del_range(r, at, 1); }
+
+// replaces the whole text of r; takes ownership of chars (len + 1 bytes,
+// nul terminated)
+void row_set(row *r, char *chars, int len) {
+  journal_record(J_SET_ROW, r - E.r, 0, len, chars);
+  text_retire(r->chars, r->refs, r->gen);
+  r->refs = NULL;
+  r->gen = E.snaps.gen;
+  r->chars = chars;
+  r->size = len;
   update_row(r);
   E.dirty++;
 }
 
 void free_row(row *r) {
-  free(r->render);
-  free(r->chars);
-  free(r->hl);
+  words_drop(&r->words);
+  mem_free(MEM_RENDER, r->render);
+  text_retire(r->chars, r->refs, r->gen);
+  mem_free(MEM_HL, r->hl);
+  mem_free(MEM_META, r->chunks);
 }
 
-void del_row(int at) {
-  if (at < 0 || at >= E.nrows)
+// removes rows at..at + n - 1 and closes the gap with a single move
+void delete_rows(int at, int n) {
+  if (at < 0 || at >= E.nrows || n <= 0)
     return;
-  free_row(&E.r[at]);
-  memmove(&E.r[at], &E.r[at + 1], sizeof(row) * (E.nrows - at - 1));
-  E.nrows--;
+  if (n > E.nrows - at)
+    n = E.nrows - at;
+  journal_record(J_DELETE_ROWS, at, 0, n, NULL);
+  for (int i = at; i < at + n; i++)
+    free_row(&E.r[i]);
+  memmove(&E.r[at], &E.r[at + n], sizeof(row) * (E.nrows - at - n));
+  E.nrows -= n;
+  for (int j = at; j < E.nrows; j++)
+    E.r[j].idx = j;
+  // the row that moved up may now sit after a different comment state
+  if (at < E.nrows)
+    update_syntax(&E.r[at]);
+  E.dirty++;
+  wrap_moved(at);
+  fold_shift(at, -n);
+}
+
+void del_row(int at) { delete_rows(at, 1); }
+
+// drops every row lo + i, i < n, whose bit i is set in dead, moving the
+// survivors down in a single pass. each run of dropped rows is journaled as
+// one record; returns how many rows went.
+int compact_rows(const uint64_t *dead, int lo, int n) {
+  int w = lo, run = 0;
+  int rehl = 0; // the row just placed left a different comment state open
+  int i;
+  for (i = lo; i < lo + n && i < E.nrows; i++) {
+    int k = i - lo;
+    if (dead[k / 64] >> (k % 64) & 1) {
+      free_row(&E.r[i]);
+      run++;
+      continue;
+    }
+    if (run) {
+      journal_record(J_DELETE_ROWS, w, 0, run, NULL);
+      fold_shift(w, -run);
+    }
+    if (w != i) {
+      E.r[w] = E.r[i];
+      E.r[w].idx = w;
+    }
+    // the rows in front of this one changed, so its highlighting may have
+    if (E.syntax && (run || rehl))
+      rehl = syntax_row(&E.r[w], w > 0 && E.r[w - 1].hl_open_comment);
+    run = 0;
+    w++;
+  }
+  if (run) {
+    journal_record(J_DELETE_ROWS, w, 0, run, NULL);
+    fold_shift(w, -run);
+  }
+  int removed = i - w;
+  if (removed == 0)
+    return 0;
+  memmove(&E.r[w], &E.r[i], sizeof(row) * (E.nrows - i));
+  E.nrows -= removed;
+  wrap_moved(lo);
+  for (int j = w; j < E.nrows; j++)
+    E.r[j].idx = j;
+  if (w < E.nrows && (run || rehl))
+    update_syntax(&E.r[w]);
   E.dirty++;
+  return removed;
 }
 
 void insert_char(int c) {
@@ -1130,11 +3069,13 @@ void insert_char(int c) {
 }
 
 void append_string(row *r, char *s, size_t len) {
-  r->chars = realloc(r->chars, r->size + len + 1);
+  journal_record(J_APPEND, r - E.r, 0, len, s);
+  row_own(r);
+  r->chars = mem_realloc(MEM_CHARS, r->chars, r->size + len + 1);
   memcpy(&r->chars[r->size], s, len);
   r->size += len;
   r->chars[r->size] = '\0';
-  update_row(r);
+  update_row_at(r, r->size - len, 0, len);
   E.dirty++;
 }
 
@@ -1155,24 +3096,817 @@ void del_char() {
   }
 }
 
-char *rts(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.nrows; j++)
-    totlen += E.r[j].size + 1;
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.nrows; j++) {
-    memcpy(p, E.r[j].chars, E.r[j].size);
-    p += E.r[j].size;
-    *p = '\n';
-    p++;
+// clipboard
+
+/* nothing clipboard related happens until the first "+ yank or put. then,
+ * unless $POUND_CLIPBOARD names one, a backend is picked: libclipboard,
+ * dlopened so that X11 is only ever loaded with a $DISPLAY to talk to; OSC
+ * 52, which asks the terminal to set its clipboard and so also works over
+ * ssh, but can't be read back; or, failing both, a buffer inside the
+ * editor. */
+enum clip_backend { CLIP_NONE, CLIP_X11, CLIP_OSC52, CLIP_INTERNAL };
+
+struct {
+  int backend;
+  void *cb;
+  char *(*text)(void *cb);
+  bool (*set_text)(void *cb, const char *s);
+  char *last; // what was copied last, for backends that can't be read
+} clip = {CLIP_NONE, NULL, NULL, NULL, NULL};
+
+int clip_x11() {
+  if (getenv("DISPLAY") == NULL)
+    return 0;
+  void *lib = dlopen("libclipboard.so", RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL)
+    lib = dlopen("libclipboard.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (lib == NULL)
+    return 0;
+  void *(*new)(void *) = (void *(*)(void *))dlsym(lib, "clipboard_new");
+  clip.text = (char *(*)(void *))dlsym(lib, "clipboard_text");
+  clip.set_text =
+      (bool (*)(void *, const char *))dlsym(lib, "clipboard_set_text");
+  if (new && clip.text && clip.set_text && (clip.cb = new(NULL)))
+    return 1;
+  dlclose(lib);
+  return 0;
+}
+
+void clip_init() {
+  char *want = getenv("POUND_CLIPBOARD");
+  char *term = getenv("TERM");
+  if ((want == NULL || strcmp(want, "x11") == 0) && clip_x11())
+    clip.backend = CLIP_X11;
+  // a daemon's buffer has no terminal of its own, the sequence goes to
+  // whichever client is attached through term_write
+  else if (want ? strcmp(want, "osc52") == 0
+                : E.host.on ||
+                      (isatty(STDOUT_FILENO) && term &&
+                       strcmp(term, "dumb") != 0 && strcmp(term, "linux") != 0))
+    clip.backend = CLIP_OSC52;
+  else
+    clip.backend = CLIP_INTERNAL;
+}
+
+void clip_osc52(const char *s, int len) {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  struct buffer b = BUFFER_INIT;
+  buffer_append(&b, "\x1b]52;c;", 7);
+  for (int i = 0; i < len; i += 3) {
+    unsigned v = (unsigned char)s[i] << 16;
+    if (i + 1 < len)
+      v |= (unsigned char)s[i + 1] << 8;
+    if (i + 2 < len)
+      v |= (unsigned char)s[i + 2];
+    char out[4] = {b64[v >> 18 & 63], b64[v >> 12 & 63],
+                   i + 1 < len ? b64[v >> 6 & 63] : '=',
+                   i + 2 < len ? b64[v & 63] : '='};
+    buffer_append(&b, out, 4);
+  }
+  buffer_append(&b, "\x07", 1);
+  term_write(b.b, b.len);
+  free(b.b);
+}
+
+void clip_set(const char *s, int len) {
+  if (clip.backend == CLIP_NONE)
+    clip_init();
+  free(clip.last);
+  clip.last = NULL;
+  if (clip.backend == CLIP_X11) {
+    clip.set_text(clip.cb, s);
+    return;
+  }
+  if (clip.backend == CLIP_OSC52)
+    clip_osc52(s, len);
+  clip.last = malloc(len + 1);
+  memcpy(clip.last, s, len);
+  clip.last[len] = '\0';
+}
+
+// returns a malloced copy of the clipboard text, or NULL
+char *clip_get() {
+  if (clip.backend == CLIP_NONE)
+    clip_init();
+  if (clip.backend == CLIP_X11)
+    return clip.text(clip.cb);
+  return clip.last ? strdup(clip.last) : NULL;
+}
+
+// registers
+
+/* yanking doesn't copy text. a register is a list of pieces pointing into the
+ * rows' own buffers, which are shared via row->refs until either side lets go
+ * (see row_own), so yanking or deleting a huge range costs a piece per line
+ * and no text. the text is only flattened when it leaves the editor through
+ * the "+ register, the system clipboard. */
+void reg_clear(struct reg *rg) {
+  for (int i = 0; i < rg->n; i++)
+    text_release(rg->p[i].chars, rg->p[i].refs);
+  free(rg->p);
+  rg->p = NULL;
+  rg->n = 0;
+}
+
+struct piece reg_share(row *r, int off, int len) {
+  if (r->refs == NULL) {
+    r->refs = mem_malloc(MEM_META, sizeof(int));
+    *r->refs = 1;
+    // a snapshot reading the text gets a count of its own, see // snapshots
+    if (snap_covers(r->gen)) {
+      (*r->refs)++;
+      snap_retire(r->chars, r->refs, r->gen);
+    }
+  }
+  (*r->refs)++;
+  struct piece p = {r->chars, r->refs, off, len};
+  return p;
+}
+
+char *reg_flatten(struct reg *rg, int *len) {
+  int total = 0;
+  for (int i = 0; i < rg->n; i++)
+    total += rg->p[i].len + 1;
+  char *buf = malloc(total + 1);
+  char *w = buf;
+  for (int i = 0; i < rg->n; i++) {
+    memcpy(w, rg->p[i].chars + rg->p[i].off, rg->p[i].len);
+    w += rg->p[i].len;
+    if (i + 1 < rg->n || rg->linewise)
+      *w++ = '\n';
   }
+  *w = '\0';
+  *len = w - buf;
   return buf;
 }
 
+// splits text coming from outside into privately owned pieces
+void reg_from_text(struct reg *rg, const char *s, int len) {
+  rg->linewise = len > 0 && s[len - 1] == '\n';
+  if (rg->linewise)
+    len--;
+  const char *end = s + len;
+  rg->n = 1;
+  for (const char *q = s; q < end && (q = memchr(q, '\n', end - q)); q++)
+    rg->n++;
+  rg->p = malloc(sizeof(struct piece) * rg->n);
+  for (int i = 0; i < rg->n; i++) {
+    const char *nl = memchr(s, '\n', end - s);
+    int n = (nl ? nl : end) - s;
+    if (n > 0 && nl && s[n - 1] == '\r')
+      n--;
+    struct piece *p = &rg->p[i];
+    p->chars = mem_malloc(MEM_CHARS, n + 1);
+    memcpy(p->chars, s, n);
+    p->chars[n] = '\0';
+    p->refs = mem_malloc(MEM_META, sizeof(int));
+    *p->refs = 1;
+    p->off = 0;
+    p->len = n;
+    s = nl ? nl + 1 : end;
+  }
+}
+
+// takes rg over as the unnamed register, and the picked one if any
+void reg_store(struct reg *rg) {
+  int name = E.regname;
+  E.regname = 0;
+  if (name >= 'a' && name <= 'z') {
+    struct reg *named = &E.reg[name - 'a' + 1];
+    reg_clear(named);
+    *named = *rg;
+    named->p = malloc(sizeof(struct piece) * rg->n);
+    for (int i = 0; i < rg->n; i++) {
+      named->p[i] = rg->p[i];
+      (*rg->p[i].refs)++;
+    }
+  } else if (name == '+') {
+    int len;
+    char *text = reg_flatten(rg, &len);
+    clip_set(text, len);
+    free(text);
+  }
+  reg_clear(&E.reg[0]);
+  E.reg[0] = *rg;
+}
+
+// yanks from start to end (exclusive), or the whole rows when linewise
+void reg_yank(struct cursor start, struct cursor end, int linewise) {
+  struct reg rg;
+  rg.linewise = linewise;
+  rg.n = end.y - start.y + 1;
+  rg.p = malloc(sizeof(struct piece) * rg.n);
+  for (int y = start.y; y <= end.y; y++) {
+    row *r = &E.r[y];
+    int from = !linewise && y == start.y ? start.x : 0;
+    int to = !linewise && y == end.y ? end.x : r->size;
+    if (to > r->size)
+      to = r->size;
+    if (from > to)
+      from = to;
+    rg.p[y - start.y] = reg_share(r, from, to - from);
+  }
+  reg_store(&rg);
+}
+
+// inserts one row per piece at at with a single move of the rows below;
+// counted pieces covering a whole row text share it instead of copying
+void insert_pieces(int at, struct piece *p, int n) {
+  E.r = mem_realloc(MEM_ROWS, E.r, sizeof(row) * (E.nrows + n));
+  memmove(&E.r[at + n], &E.r[at], sizeof(row) * (E.nrows - at));
+  E.nrows += n;
+  wrap_moved(at);
+  fold_shift(at, n);
+  for (int j = at + n; j < E.nrows; j++)
+    E.r[j].idx = j;
+  for (int i = 0; i < n; i++) {
+    row *r = &E.r[at + i];
+    r->idx = at + i;
+    r->size = p[i].len;
+    if (p[i].refs && p[i].off == 0 && p[i].chars[p[i].len] == '\0') {
+      r->chars = p[i].chars;
+      r->refs = p[i].refs;
+      (*r->refs)++;
+    } else {
+      r->chars = mem_malloc(MEM_CHARS, p[i].len + 1);
+      memcpy(r->chars, p[i].chars + p[i].off, p[i].len);
+      r->chars[p[i].len] = '\0';
+      r->refs = NULL;
+    }
+    r->rsize = 0;
+    r->render = NULL;
+    r->hl = NULL;
+    r->hl_open_comment = 0;
+    r->chunks = NULL;
+    r->gen = E.snaps.gen;
+    r->words = (struct word_row){0, NULL};
+    journal_record(J_INSERT_ROW, at + i, 0, r->size, r->chars);
+    render_row(r);
+  }
+  int changed = 0;
+  for (int i = at; i < at + n; i++)
+    changed = syntax_row(&E.r[i], i > 0 && E.r[i - 1].hl_open_comment);
+  if (changed && at + n < E.nrows)
+    update_syntax(&E.r[at + n]);
+  E.dirty++;
+}
+
+// puts lines at the cursor, the first joining the text before it and the last
+// the text after it
+void put_pieces(struct piece *p, int n) {
+  if (E.cur.y == E.nrows)
+    append_row(E.nrows, "", 0);
+  row *r = &E.r[E.cur.y];
+  if (E.cur.x > r->size)
+    E.cur.x = r->size;
+  struct piece *first = &p[0];
+  struct piece *last = &p[n - 1];
+  if (n == 1) {
+    row_insert(r, E.cur.x, first->chars + first->off, first->len);
+    E.cur.x += first->len;
+  } else {
+    // the cursor row keeps its head, the last pasted line gets its tail
+    int taillen = r->size - E.cur.x;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &r->chars[E.cur.x], taillen);
+    row_del_range(r, E.cur.x, taillen);
+    append_string(r, first->chars + first->off, first->len);
+    insert_pieces(E.cur.y + 1, p + 1, n - 1);
+    E.cur.y += n - 1;
+    E.cur.x = last->len;
+    append_string(&E.r[E.cur.y], tail, taillen);
+    free(tail);
+  }
+}
+
+// puts the picked register at the cursor, or below the cursor row if it holds
+// whole lines. an empty unnamed register falls back to the system clipboard.
+void reg_put() {
+  int name = E.regname;
+  E.regname = 0;
+  struct reg outside = {NULL, 0, 0};
+  struct reg *rg = &E.reg[name >= 'a' && name <= 'z' ? name - 'a' + 1 : 0];
+  if (name == '+' || (name == 0 && rg->n == 0)) {
+    char *text = clip_get();
+    if (text == NULL)
+      return;
+    reg_from_text(&outside, text, strlen(text));
+    free(text);
+    rg = &outside;
+  }
+  if (rg->n == 0) {
+    status_message("Register %c is empty", name ? name : '"');
+    return;
+  }
+
+  if (rg->linewise) {
+    int at = E.cur.y < E.nrows ? E.cur.y + 1 : E.nrows;
+    insert_pieces(at, rg->p, rg->n);
+    E.cur.y = at;
+    E.cur.x = 0;
+  } else {
+    put_pieces(rg->p, rg->n);
+  }
+  reg_clear(&outside);
+}
+
+// text from a bracketed paste goes in at the cursor exactly as it came, all
+// lines at once and without the auto pairing and indenting of typed keys
+void paste() {
+  struct buffer *b = &E.input.paste;
+  if (b->len == 0 || !editable())
+    return;
+  const char *s = b->b, *end = b->b + b->len;
+  int n = 1;
+  for (const char *q = s; (q = memchr(q, '\n', end - q)); q++)
+    n++;
+  struct piece *p = malloc(sizeof(struct piece) * n);
+  for (int i = 0; i < n; i++) {
+    const char *nl = memchr(s, '\n', end - s);
+    // no refs: insert_pieces copies the text
+    p[i] = (struct piece){(char *)s, NULL, 0, (nl ? nl : end) - s};
+    s = nl ? nl + 1 : end;
+  }
+  put_pieces(p, n);
+  free(p);
+}
+
+// orders the selection and clamps it to the buffer; -1 if it is empty
+int selection_bounds(struct cursor *start, struct cursor *end) {
+  *start = E.select->initial;
+  *end = E.select->final;
+  if (start->y > end->y || (start->y == end->y && start->x > end->x)) {
+    struct cursor t = *start;
+    *start = *end;
+    *end = t;
+  }
+  if (start->y < 0 || start->y >= E.nrows)
+    return -1;
+  if (end->y >= E.nrows) {
+    end->y = E.nrows - 1;
+    end->x = E.r[end->y].size;
+  }
+  if (end->x > E.r[end->y].size)
+    end->x = E.r[end->y].size;
+  return 0;
+}
+
+void delete_selection() {
+  struct cursor start, end;
+  if (selection_bounds(&start, &end) == -1)
+    return;
+  reg_yank(start, end, 0);
+  if (start.y == end.y) {
+    row_del_range(&E.r[start.y], start.x, end.x - start.x);
+  } else {
+    row *r = &E.r[start.y];
+    row *r2 = &E.r[end.y];
+    // the first row keeps its head and takes over the tail of the last one
+    row_del_range(r, start.x, r->size - start.x);
+    append_string(r, &r2->chars[end.x], r2->size - end.x);
+    delete_rows(start.y + 1, end.y - start.y);
+  }
+  E.cur = start;
+  E.mode = NORMAL;
+}
+
+/* a series of row deletes each starting at or past the one before, as :g
+ * (compact_rows) logs them, goes through compact_rows in one pass, and a
+ * series of rows inserted one below the other, as insert_pieces logs them,
+ * through insert_pieces; replayed a record at a time every one of them would
+ * move all the rows below. both return p past the records used up, and add
+ * their count to *applied. */
+char *journal_replay_deletes(char *p, char *end, int y, int n, int *applied) {
+  int lo = y, last = y, removed = n, cap = 0, nruns = 0;
+  struct span *runs = NULL;
+  struct journal_record rec = {J_DELETE_ROWS, y, 0, n};
+  do {
+    if (nruns == cap) {
+      cap = cap ? cap * 2 : 64;
+      runs = realloc(runs, sizeof(struct span) * cap);
+    }
+    // where the run is in the rows as they are before any of the series
+    int at = rec.row + removed - rec.n;
+    runs[nruns++] = (struct span){at, at + rec.n - 1, 0};
+    last = rec.row;
+    (*applied)++;
+    if (end - p < (long)sizeof(rec))
+      break;
+    memcpy(&rec, p, sizeof(rec));
+    if (rec.op != J_DELETE_ROWS || rec.n == 0 || (int)rec.row < last ||
+        rec.row + removed + rec.n > (uint32_t)E.nrows)
+      break;
+    removed += rec.n;
+    p += sizeof(rec);
+  } while (1);
+
+  if (nruns == 1) {
+    delete_rows(y, n);
+  } else {
+    int span = runs[nruns - 1].end + 1 - lo;
+    uint64_t *dead = calloc((span + 63) / 64, sizeof(uint64_t));
+    for (int i = 0; i < nruns; i++)
+      for (int k = runs[i].start - lo; k <= runs[i].end - lo; k++)
+        dead[k / 64] |= 1ull << (k % 64);
+    compact_rows(dead, lo, span);
+    free(dead);
+  }
+  free(runs);
+  return p;
+}
+
+char *journal_replay_inserts(char *p, char *end, int y, char *s, int n,
+                             int *applied) {
+  int np = 0, cap = 0;
+  struct piece *pieces = NULL;
+  struct journal_record rec = {J_INSERT_ROW, y, 0, n};
+  do {
+    if (np == cap) {
+      cap = cap ? cap * 2 : 64;
+      pieces = realloc(pieces, sizeof(struct piece) * cap);
+    }
+    // no refs: insert_pieces copies the text out of the journal
+    pieces[np++] = (struct piece){s, NULL, 0, rec.n};
+    (*applied)++;
+    if (end - p < (long)sizeof(rec))
+      break;
+    memcpy(&rec, p, sizeof(rec));
+    if (rec.op != J_INSERT_ROW || rec.row != (uint32_t)(y + np) ||
+        end - p - (long)sizeof(rec) < (long)rec.n)
+      break;
+    p += sizeof(rec);
+    s = p;
+    p += rec.n;
+  } while (1);
+
+  if (np == 1)
+    append_row(y, pieces[0].chars, pieces[0].len);
+  else
+    insert_pieces(y, pieces, np);
+  free(pieces);
+  return p;
+}
+
+// applies records from p on; *stop is left at the first one not applied
+int journal_replay(char *p, char *end, char **stop) {
+  int applied = 0;
+  *stop = p;
+  while (end - p >= (long)sizeof(struct journal_record)) {
+    struct journal_record rec;
+    memcpy(&rec, p, sizeof(rec));
+    p += sizeof(rec);
+    char *s = p;
+    if (journal_has_payload(rec.op)) {
+      // a torn write at the tail just means the last batch never made it
+      if (end - p < (long)rec.n)
+        break;
+      p += rec.n;
+    }
+    int y = rec.row, x = rec.col, n = rec.n;
+    if (rec.op == J_INSERT_ROW && y <= E.nrows) {
+      p = journal_replay_inserts(p, end, y, s, n, &applied);
+      *stop = p;
+      continue;
+    } else if (rec.op == J_DELETE_ROW && y < E.nrows) {
+      del_row(y);
+    } else if (rec.op == J_INSERT && y < E.nrows && x <= E.r[y].size) {
+      row_insert(&E.r[y], x, s, n);
+    } else if (rec.op == J_DELETE && y < E.nrows && x < E.r[y].size) {
+      row_del_range(&E.r[y], x, n);
+    } else if (rec.op == J_APPEND && y < E.nrows) {
+      append_string(&E.r[y], s, n);
+    } else if (rec.op == J_DELETE_ROWS && n > 0 && y + n <= E.nrows) {
+      p = journal_replay_deletes(p, end, y, n, &applied);
+      *stop = p;
+      continue;
+    } else if (rec.op == J_SET_ROW && y < E.nrows) {
+      char *chars = mem_malloc(MEM_CHARS, n + 1);
+      memcpy(chars, s, n);
+      chars[n] = '\0';
+      row_set(&E.r[y], chars, n);
+    } else if (rec.op == J_SORT && n > 0 && y + n <= E.nrows) {
+      sort_rows(y, y + n - 1, x);
+    } else {
+      break;
+    }
+    applied++;
+    *stop = p;
+  }
+  return applied;
+}
+
+// look for a journal left behind by a session that never saved or quit
+void journal_open() {
+  struct journal *j = &E.journal;
+  free(j->path);
+  j->path = journal_path(E.filename);
+  j->fd = -1;
+  j->pending.len = 0;
+  if (stat(E.filename, &j->base) == -1)
+    memset(&j->base, 0, sizeof(j->base));
+
+  int fd = open(j->path, O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat st;
+  char *data = NULL;
+  ssize_t got = -1;
+  if (fstat(fd, &st) != -1 && st.st_size >= (off_t)sizeof(struct journal_header)) {
+    data = malloc(st.st_size);
+    got = read(fd, data, st.st_size);
+  }
+  close(fd);
+
+  struct journal_header h;
+  if (got < (ssize_t)sizeof(h)) {
+    free(data);
+    return;
+  }
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+      h.size != j->base.st_size || h.mtime != j->base.st_mtime ||
+      h.ino != (int64_t)j->base.st_ino) {
+    // the file changed underneath the journal; keep it around, don't apply it
+    char old[strlen(j->path) + 5];
+    sprintf(old, "%s.old", j->path);
+    rename(j->path, old);
+    status_message("Stale journal moved to %s", old);
+    free(data);
+    return;
+  }
+
+  j->replaying = 1;
+  char *stop;
+  int applied = journal_replay(data + sizeof(h), data + got, &stop);
+  j->replaying = 0;
+  off_t valid = stop - data;
+
+  // cut off a torn or unusable tail, otherwise new records would land
+  // behind it and the next recovery would stop at the same place
+  j->fd = open(j->path, O_WRONLY | O_APPEND);
+  if (j->fd != -1 && ftruncate(j->fd, valid) == -1) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  j->last_flush = time(NULL);
+  E.dirty = applied;
+  status_message("Recovered %d edits from %s", applied, j->path);
+  free(data);
+}
+
+// called once the buffer matches the disk again
+void journal_reset() {
+  struct journal *j = &E.journal;
+  if (E.filename == NULL)
+    return;
+  if (j->path == NULL)
+    j->path = journal_path(E.filename);
+  if (j->fd != -1) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  unlink(j->path);
+  j->pending.len = 0;
+  stat(E.filename, &j->base);
+}
+
+// called once the disk holds the buffer as it was when the journal was mark
+// bytes long: what was journaled after that becomes the journal of the file
+void journal_rebase(off_t mark) {
+  struct journal *j = &E.journal;
+  if (j->path == NULL)
+    return;
+  journal_flush();
+  stat(E.filename, &j->base);
+  if (j->fd == -1)
+    return;
+  // it is only open for writing
+  off_t end = lseek(j->fd, 0, SEEK_END);
+  char *rest = malloc(end > mark ? end - mark : 1);
+  ssize_t n = 0;
+  int fd = open(j->path, O_RDONLY | O_CLOEXEC);
+  if (fd != -1 && end > mark)
+    n = pread(fd, rest, end - mark, mark);
+  if (fd != -1)
+    close(fd);
+  close(j->fd);
+  j->fd = -1;
+  journal_start();
+  if (j->fd != -1 && n > 0) {
+    if (write(j->fd, rest, n) == n)
+      fdatasync(j->fd);
+    else
+      status_message("Journal write failed: %s", strerror(errno));
+  }
+  free(rest);
+}
+
+void journal_close() {
+  struct journal *j = &E.journal;
+  if (j->fd != -1)
+    close(j->fd);
+  j->fd = -1;
+  if (j->path)
+    unlink(j->path);
+}
+
+void quit_editor() {
+  // the daemon keeps the buffer, only the terminal goes
+  if (E.host.on) {
+    write_all(E.ttyfd, "\x1b[2J\x1b[H", 7);
+    host_detach(E.ttyfd);
+    return;
+  }
+  save_wait();
+  cache_leave();
+  journal_close();
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  exit(0);
+}
+
+// saving
+
+/* a save takes a snapshot of the rows (see // snapshots: an edit copies a
+ * row the snapshot covers before touching it), and a writer thread puts that
+ * on disk while editing goes on. it writes a file next to the real one and
+ * renames it over it once it is complete, so until then the old file and
+ * the journal on top of it are still good. when the
+ * write is in, the buffer is only clean again if nothing was edited since the
+ * snapshot; otherwise the journal is started over from the edits after it. */
+#define SAVE_CHUNK (1 << 20)
+
+// the temporary file a save writes, next to path
+char *save_tmp_path(const char *path) {
+  const char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  char *tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%.*s.%s.save", dirlen, path, path + dirlen);
+  return tmp;
+}
+
+// writes the snapshot out; returns 0 or an errno
+int save_write(struct saving *sv) {
+  // a link is written through, to where it points
+  char *target = realpath(sv->path, NULL);
+  if (target == NULL)
+    target = strdup(sv->path);
+  struct stat st;
+  int exists = stat(target, &st) == 0;
+  // a file with other names has to be overwritten where it is
+  int in_place = exists && st.st_nlink > 1;
+  char *tmp = in_place ? NULL : save_tmp_path(target);
+  int fd = in_place ? open(target, O_WRONLY | O_CLOEXEC)
+                    : open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int err = 0;
+  if (fd == -1) {
+    err = errno;
+    goto out;
+  }
+  if (exists && !in_place)
+    fchmod(fd, st.st_mode & 07777);
+
+  struct buffer b = BUFFER_INIT;
+  off_t out = 0;
+  for (int i = 0; i < sv->n && !err; i++) {
+    struct piece *p = &sv->p[i];
+    buffer_append(&b, p->chars + p->off, p->len);
+    buffer_append(&b, "\n", 1);
+    __atomic_add_fetch(&sv->written, p->len + 1, __ATOMIC_RELAXED);
+    // a compressed file goes in one piece once it is all there
+    if (sv->compress == COMPRESS_NONE &&
+        (b.len >= SAVE_CHUNK || i == sv->n - 1)) {
+      if (write_all(fd, b.b, b.len) == -1)
+        err = errno;
+      out += b.len;
+      b.len = 0;
+    }
+  }
+  if (!err && sv->compress != COMPRESS_NONE) {
+    int clen;
+    char *cbuf = compress_buffer(b.b, b.len, &clen);
+    if (cbuf == NULL)
+      err = EIO;
+    else if (write_all(fd, cbuf, clen) == -1)
+      err = errno;
+    out = clen;
+    free(cbuf);
+  }
+  buffer_free(&b);
+  sv->size = out;
+  if (!err && in_place && ftruncate(fd, out) == -1)
+    err = errno;
+  if (!err && fdatasync(fd) == -1)
+    err = errno;
+  close(fd);
+  if (!err && !in_place && rename(tmp, target) == -1)
+    err = errno;
+  if (err && !in_place)
+    unlink(tmp);
+out:
+  free(tmp);
+  free(target);
+  return err;
+}
+
+void *save_writer(void *arg) {
+  struct saving *sv = arg;
+  sv->err = save_write(sv);
+  __atomic_store_n(&sv->done, 1, __ATOMIC_RELEASE);
+  editor_wake();
+  return NULL;
+}
+
+void save_start() {
+  struct saving *sv = &E.saving;
+  sv->n = E.nrows;
+  sv->p = malloc(sizeof(struct piece) * (E.nrows ? E.nrows : 1));
+  sv->gen = snap_take(sv->p);
+  sv->total = 0;
+  for (int i = 0; i < sv->n; i++)
+    sv->total += sv->p[i].len + 1;
+  sv->written = 0;
+  sv->shown = -1;
+  sv->edits = E.journal.edits;
+  sv->compress = E.compress;
+  sv->path = strdup(E.filename);
+  // the edits made from here on are the journal of the saved file
+  journal_flush();
+  sv->mark = E.journal.fd != -1 ? lseek(E.journal.fd, 0, SEEK_END)
+                                : (off_t)sizeof(struct journal_header);
+  sv->err = 0;
+  sv->done = 0;
+  sv->active = 1;
+  if (pthread_create(&sv->thread, NULL, save_writer, sv) != 0)
+    save_writer(sv);
+}
+
+// on the main thread, once the writer is through
+void save_finish() {
+  struct saving *sv = &E.saving;
+  pthread_join(sv->thread, NULL);
+  sv->active = 0;
+  snap_release(sv->p, sv->n, sv->gen);
+  free(sv->p);
+  sv->p = NULL;
+  if (sv->err) {
+    status_message("Can't save! I/O error: %s", strerror(sv->err));
+  } else {
+    if (E.journal.edits == sv->edits) {
+      E.dirty = 0;
+      journal_reset();
+    } else {
+      journal_rebase(sv->mark);
+    }
+    E.diff.stale = 1;
+    status_message("%lld bytes written to disk", (long long)sv->size);
+  }
+  free(sv->path);
+  sv->path = NULL;
+}
+
+void save_wait() {
+  if (!E.saving.active)
+    return;
+  if (!__atomic_load_n(&E.saving.done, __ATOMIC_ACQUIRE)) {
+    status_message("Waiting for the save to finish…");
+    refresh_screen();
+  }
+  save_finish();
+}
+
+int save_poll() {
+  struct saving *sv = &E.saving;
+  if (!sv->active)
+    return 0;
+  if (__atomic_load_n(&sv->done, __ATOMIC_ACQUIRE)) {
+    save_finish();
+    return IDLE_REDRAW;
+  }
+  // the status bar shows how far along it is
+  int pct = sv->total ? __atomic_load_n(&sv->written, __ATOMIC_RELAXED) *
+                            100 / sv->total
+                      : 0;
+  if (pct == sv->shown)
+    return 0;
+  sv->shown = pct;
+  return IDLE_REDRAW;
+}
+
 void save() {
+  if (E.stream.active) {
+    status_message("Still loading, can't save yet");
+    return;
+  }
+  // one at a time, so they reach the disk in order
+  save_wait();
+  // a file that didn't load completely must not be written back over itself
+  if (E.filename && E.stream.err) {
+    E.filename = NULL;
+    E.compress = COMPRESS_NONE;
+    journal_close();
+  }
   if (E.filename == NULL) {
 
     E.filename = start_prompt("Save as: %s", NULL);
@@ -1182,68 +3916,2382 @@ void save() {
     }
     detect();
   }
-  int len;
-  char *buf = rts(&len);
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        status_message("%d bytes written to disk", len);
-        return;
-      }
+  save_start();
+}
+
+// loading
+
+/* plain files are mapped and split in parallel: every worker counts the
+ * newlines in its slice of the file with memchr, a prefix sum over those
+ * counts tells each slice which row its first line becomes, and a second
+ * pass has every worker build its rows (text + render) straight into their
+ * final slots in E.r. only highlighting, whose multi-line comment state
+ * flows from row to row, runs as one sequential pass afterwards. */
+#define LOAD_SLICE_MIN (256 * 1024)
+
+struct load {
+  const char *data;
+  size_t size;
+  size_t slice;
+  int *lines; // newlines per slice, then the first row of each slice
+  uint64_t *offsets; // where each row starts, kept for the cache
+};
+
+void load_count(void *ctx, int lo, int hi) {
+  struct load *ld = ctx;
+  for (int k = lo; k < hi; k++) {
+    const char *p = ld->data + k * ld->slice;
+    const char *end = ld->data + ld->size;
+    if (end > p + ld->slice)
+      end = p + ld->slice;
+    int n = 0;
+    while (p < end && (p = memchr(p, '\n', end - p))) {
+      n++;
+      p++;
     }
-    close(fd);
+    ld->lines[k] = n;
   }
-  free(buf);
-  status_message("Can't save! I/O error: %s", strerror(errno));
 }
 
-void editor_open(char *filename) {
-  free(E.filename);
-  E.filename = filename;
-  detect();
-  FILE *fp = fopen(filename, "r");
-  if (!fp)
-    die("fopen");
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+// sets up row at from n bytes of file text, rendered but not highlighted
+void row_fill(row *r, int at, const char *s, size_t n) {
+  r->idx = at;
+  r->size = n;
+  r->chars = mem_malloc(MEM_CHARS, n + 1);
+  memcpy(r->chars, s, n);
+  r->chars[n] = '\0';
+  r->rsize = 0;
+  r->render = NULL;
+  r->hl = NULL;
+  r->hl_open_comment = 0;
+  r->refs = NULL;
+  r->chunks = NULL;
+  r->gen = E.snaps.gen;
+  r->words = (struct word_row){0, NULL};
+  render_row(r);
+}
 
-  linelen = getline(&line, &linecap, fp);
-  if (linelen != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    append_row(E.nrows, line, linelen);
+// a slice owns the lines whose newline falls inside it, plus the last
+// unterminated line if it is the final slice
+void load_build(void *ctx, int lo, int hi) {
+  struct load *ld = ctx;
+  const char *data = ld->data;
+  const char *eof = data + ld->size;
+  for (int k = lo; k < hi; k++) {
+    const char *p = data + k * ld->slice;
+    const char *end = p + ld->slice < eof ? p + ld->slice : eof;
+    // a slice without a newline only owns something if it is the last one
+    if (end != eof && memchr(p, '\n', end - p) == NULL)
+      continue;
+    // the first line may have started in an earlier slice
+    const char *start = p;
+    if (p > data && p[-1] != '\n') {
+      const char *prev = memrchr(data, '\n', p - data);
+      start = prev ? prev + 1 : data;
+    }
+    int at = ld->lines[k];
+    while (start < eof) {
+      const char *nl = p < end ? memchr(p, '\n', end - p) : NULL;
+      if (nl == NULL && end != eof)
+        break;
+      const char *stop = nl ? nl : eof;
+      if (nl == NULL && start == eof)
+        break;
+      size_t n = stop - start;
+      if (nl && n > 0 && start[n - 1] == '\r')
+        n--;
+      row *r = &E.r[at];
+      if (ld->offsets)
+        ld->offsets[at] = start - data;
+      row_fill(r, at, start, n);
+      // without a syntax highlighting is per row and can happen here too
+      if (E.syntax == NULL)
+        syntax_row(r, 0);
+      at++;
+      if (nl == NULL)
+        break;
+      start = p = nl + 1;
+    }
   }
+}
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    append_row(E.nrows, line, linelen);
+// session cache
+
+/* reopening a big file that hasn't changed skips finding its lines and
+ * highlighting them in order: $XDG_CACHE_HOME/pound keeps, per file, where
+ * each row starts, which rows end inside a block comment and where the
+ * cursor and view were. it is keyed by path (the cache file name is a hash
+ * of it), inode, size and mtime, so a file changed by anyone else misses.
+ * with the comment state known up front rows are built and highlighted in
+ * parallel straight from the offsets. files under CACHE_MIN_BYTES load fast
+ * enough as they are and aren't cached. */
+#define CACHE_MAGIC 0x31434e50 // "PNC1"
+#define CACHE_MIN_BYTES (4 << 20)
+
+struct cache_header {
+  uint32_t magic;
+  uint32_t open_line;
+  uint64_t dev, ino, size;
+  int64_t mtime_sec, mtime_nsec;
+  int64_t nrows;
+  char filetype[16]; // the syntax the comment bits were taken with
+  int32_t cur_x, cur_y, rowoff, coloff;
+};
+// followed by nrows + 1 row offsets (uint64_t), the last one size +
+// open_line, and a bit per row for hl_open_comment
+
+char *cache_path(const char *filename) {
+  char *real = realpath(filename, NULL);
+  if (real == NULL)
+    return NULL;
+  uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+  for (char *p = real; *p; p++)
+    h = (h ^ (unsigned char)*p) * 0x100000001b3ull;
+  free(real);
+
+  char dir[PATH_MAX];
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (xdg && *xdg)
+    snprintf(dir, sizeof(dir), "%s", xdg);
+  else if (home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return NULL;
+  mkdir(dir, 0700);
+  strncat(dir, "/pound", sizeof(dir) - strlen(dir) - 1);
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    return NULL;
+  char *path = malloc(strlen(dir) + 18);
+  sprintf(path, "%s/%016llx", dir, (unsigned long long)h);
+  return path;
+}
+
+void cache_key(struct cache_header *h, struct stat *st) {
+  memset(h, 0, sizeof(*h));
+  h->magic = CACHE_MAGIC;
+  h->dev = st->st_dev;
+  h->ino = st->st_ino;
+  h->size = st->st_size;
+  h->mtime_sec = st->st_mtim.tv_sec;
+  h->mtime_nsec = st->st_mtim.tv_nsec;
+  if (E.syntax)
+    snprintf(h->filetype, sizeof(h->filetype), "%s", E.syntax->filetype);
+}
+
+int cache_matches(struct cache_header *h, struct stat *st) {
+  struct cache_header key;
+  cache_key(&key, st);
+  return h->magic == key.magic && h->dev == key.dev && h->ino == key.ino &&
+         h->size == key.size && h->mtime_sec == key.mtime_sec &&
+         h->mtime_nsec == key.mtime_nsec;
+}
+
+// writes the cache for the file as stat'ed in st, whose rows start at off
+void cache_write(struct stat *st, const uint64_t *off, int open_line) {
+  if (E.cache.path == NULL)
+    return;
+  struct cache_header h;
+  cache_key(&h, st);
+  h.open_line = open_line;
+  h.nrows = E.nrows;
+  h.cur_x = E.cur.x;
+  h.cur_y = E.cur.y;
+  h.rowoff = E.rowoff;
+  h.coloff = E.coloff;
+
+  size_t bytes = (E.nrows + 7) / 8;
+  unsigned char *bits = calloc(bytes, 1);
+  for (int i = 0; i < E.nrows; i++)
+    if (E.r[i].hl_open_comment)
+      bits[i / 8] |= 1 << (i % 8);
+
+  // written aside and renamed over, a reader never sees half of it
+  char tmp[strlen(E.cache.path) + 8];
+  sprintf(tmp, "%s.tmp", E.cache.path);
+  FILE *fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    free(bits);
+    return;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+           fwrite(off, sizeof(uint64_t), E.nrows + 1, fp) ==
+               (size_t)E.nrows + 1 &&
+           fwrite(bits, 1, bytes, fp) == bytes;
+  if (fclose(fp) == 0 && ok)
+    rename(tmp, E.cache.path);
+  else
+    unlink(tmp);
+  free(bits);
+}
+
+struct cache_rows {
+  const char *data;
+  uint64_t size; // of the file; the mapping ends there
+  const uint64_t *off;
+  const unsigned char *bits; // NULL if taken with another syntax
+  int nrows;
+  int per; // rows per slice
+};
+
+void cache_build(void *ctx, int lo, int hi) {
+  struct cache_rows *cr = ctx;
+  for (int k = lo; k < hi; k++) {
+    int end = (k + 1) * cr->per < cr->nrows ? (k + 1) * cr->per : cr->nrows;
+    for (int i = k * cr->per; i < end; i++) {
+      const char *s = cr->data + cr->off[i];
+      size_t n = cr->off[i + 1] - cr->off[i] - 1;
+      // the last row of a file without a final newline has no \r to drop,
+      // and nothing after it to look at
+      if (n > 0 && s[n - 1] == '\r' && cr->off[i] + n < cr->size &&
+          s[n] == '\n')
+        n--;
+      row *r = &E.r[i];
+      row_fill(r, i, s, n);
+      if (cr->bits)
+        syntax_row(r, i > 0 && (cr->bits[(i - 1) / 8] >> ((i - 1) % 8) & 1));
+      else if (E.syntax == NULL)
+        syntax_row(r, 0);
+    }
+  }
+}
+
+// builds the rows of the file mapped at data from its cache; -1 on a miss
+int cache_load(struct stat *st, const char *data) {
+  int fd = open(E.cache.path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct cache_header h;
+  struct stat cst;
+  void *map = MAP_FAILED;
+  size_t mapsize = 0;
+  if (read(fd, &h, sizeof(h)) == sizeof(h) && cache_matches(&h, st) &&
+      h.nrows > 0 && h.nrows < INT_MAX && fstat(fd, &cst) == 0) {
+    mapsize = sizeof(h) + sizeof(uint64_t) * (h.nrows + 1) + (h.nrows + 7) / 8;
+    if ((size_t)cst.st_size == mapsize)
+      map = mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  struct cache_rows cr;
+  cr.data = data;
+  cr.size = st->st_size;
+  cr.off = (const uint64_t *)((char *)map + sizeof(h));
+  cr.nrows = h.nrows;
+  if (cr.off[cr.nrows] != h.size + h.open_line) {
+    munmap(map, mapsize);
+    return -1;
+  }
+  struct cache_header now;
+  cache_key(&now, st);
+  cr.bits = strcmp(h.filetype, now.filetype) == 0
+                ? (const unsigned char *)(cr.off + cr.nrows + 1)
+                : NULL;
+  int slices = nthreads() * 4;
+  cr.per = (cr.nrows + slices - 1) / slices;
+  slices = (cr.nrows + cr.per - 1) / cr.per;
+
+  E.r = mem_malloc(MEM_ROWS, sizeof(row) * cr.nrows);
+  E.nrows = cr.nrows;
+  E.wrap.stale = 1;
+  E.follow.open_line = h.open_line;
+  change_note(CHANGE_INSERT, 0, E.nrows - 1);
+  parallel_for_min(slices, 2, cache_build, &cr);
+  if (E.syntax && cr.bits == NULL) {
+    for (int i = 0; i < E.nrows; i++)
+      syntax_row(&E.r[i], i > 0 && E.r[i - 1].hl_open_comment);
+  }
+  munmap(map, mapsize);
+
+  E.cache.hit = 1;
+  E.cache.cur.x = h.cur_x;
+  E.cache.cur.y = h.cur_y;
+  E.cache.rowoff = h.rowoff;
+  E.cache.coloff = h.coloff;
+  return 0;
+}
+
+// puts the cursor and view back where they were when the file was left
+void cache_restore_view() {
+  if (!E.cache.hit || E.nrows == 0)
+    return;
+  E.cur.y = E.cache.cur.y < E.nrows ? E.cache.cur.y : E.nrows - 1;
+  E.cur.x = E.cache.cur.x < E.r[E.cur.y].size ? E.cache.cur.x : 0;
+  E.rowoff = E.cache.rowoff <= E.cur.y ? E.cache.rowoff : E.cur.y;
+  E.coloff = E.cache.coloff;
+}
+
+// on the way out: remember the cursor and view. if the buffer was saved
+// since it was cached the file is exactly its rows, so the offsets are
+// worked out from them instead of reading the file again.
+void cache_leave() {
+  struct stat st;
+  if (E.cache.path == NULL || E.filename == NULL ||
+      stat(E.filename, &st) == -1)
+    return;
+  int fd = open(E.cache.path, O_RDWR | O_CLOEXEC);
+  struct cache_header h;
+  if (fd != -1 && read(fd, &h, sizeof(h)) == sizeof(h) &&
+      cache_matches(&h, &st)) {
+    h.cur_x = E.cur.x;
+    h.cur_y = E.cur.y;
+    h.rowoff = E.rowoff;
+    h.coloff = E.coloff;
+    pwrite(fd, &h, sizeof(h), 0);
+    close(fd);
+    return;
+  }
+  if (fd != -1)
+    close(fd);
+  if (E.dirty || E.compress != COMPRESS_NONE || E.stream.active ||
+      E.follow.ifd != -1)
+    return;
+  uint64_t *off = malloc(sizeof(uint64_t) * (E.nrows + 1));
+  off[0] = 0;
+  for (int i = 0; i < E.nrows; i++)
+    off[i + 1] = off[i] + E.r[i].size + 1;
+  // anything else means the file isn't just the rows after all
+  if (off[E.nrows] == (uint64_t)st.st_size)
+    cache_write(&st, off, 0);
+  free(off);
+}
+
+// returns -1 if fd can't be mapped (pipes, devices), leaving it untouched
+int load_mapped(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return -1;
+  size_t size = st.st_size;
+  E.follow.offset = size;
+  E.follow.open_line = 0;
+  if (size == 0)
+    return 0;
+  char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return -1;
+  madvise(data, size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  if (size >= CACHE_MIN_BYTES && E.filename)
+    E.cache.path = cache_path(E.filename);
+  if (E.cache.path && cache_load(&st, data) == 0) {
+    munmap(data, size);
+    return 0;
+  }
+
+  struct load ld;
+  ld.data = data;
+  ld.size = size;
+  ld.offsets = NULL;
+  int slices = nthreads() * 4;
+  ld.slice = (size + slices - 1) / slices;
+  if (ld.slice < LOAD_SLICE_MIN)
+    ld.slice = LOAD_SLICE_MIN;
+  slices = (size + ld.slice - 1) / ld.slice;
+  ld.lines = malloc(sizeof(int) * slices);
+  parallel_for_min(slices, 2, load_count, &ld);
+
+  // prefix sum: lines[k] becomes the row the slice's first line goes to
+  int total = 0;
+  for (int k = 0; k < slices; k++) {
+    int n = ld.lines[k];
+    ld.lines[k] = total;
+    total += n;
+  }
+  E.follow.open_line = data[size - 1] != '\n';
+  if (E.follow.open_line)
+    total++;
+
+  E.r = mem_malloc(MEM_ROWS, sizeof(row) * total);
+  E.nrows = total;
+  E.wrap.stale = 1;
+  change_note(CHANGE_INSERT, 0, total - 1);
+  if (E.cache.path) {
+    ld.offsets = malloc(sizeof(uint64_t) * (total + 1));
+    ld.offsets[total] = size + E.follow.open_line;
+  }
+  parallel_for_min(slices, 2, load_build, &ld);
+  if (E.syntax) {
+    for (int i = 0; i < E.nrows; i++)
+      syntax_row(&E.r[i], i > 0 && E.r[i - 1].hl_open_comment);
+  }
+  if (ld.offsets) {
+    cache_write(&st, ld.offsets, E.follow.open_line);
+    free(ld.offsets);
+  }
+  free(ld.lines);
+  munmap(data, size);
+  return 0;
+}
+
+void editor_open(char *filename) {
+  free(E.filename);
+  E.filename = filename;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    die("open");
+  if (open_compressed(fd)) {
+    // the journal is looked at once the stream is complete
+    detect();
+    return;
+  }
+  detect();
+  if (load_mapped(fd) == 0) {
+    close(fd);
+    E.cur.x = findn(E.nrows) + 1;
+    cache_restore_view();
+    E.dirty = 0;
+    journal_open();
+    return;
+  }
+  FILE *fp = fdopen(fd, "r");
+  if (!fp)
+    die("fdopen");
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  E.follow.offset = 0;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    E.follow.offset += linelen;
+    E.follow.open_line = line[linelen - 1] != '\n';
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    append_row(E.nrows, line, linelen);
+  }
+  E.cur.x = findn(E.nrows) + 1;
+  E.dirty = 0;
+  free(line);
+  fclose(fp);
+  journal_open();
+}
+
+// appends a block of text at the end of the buffer in one go. a block can
+// end mid-line; *open_line carries that over so the next block continues the
+// last row instead of starting a new one. nothing here is an edit, so it is
+// neither journaled nor counted as dirty.
+void append_text(const char *s, size_t len, int *open_line) {
+  const char *end = s + len;
+  if (*open_line && E.nrows > 0 && len > 0) {
+    row *r = &E.r[E.nrows - 1];
+    const char *nl = memchr(s, '\n', len);
+    size_t n = (nl ? nl : end) - s;
+    row_own(r);
+    r->chars = mem_realloc(MEM_CHARS, r->chars, r->size + n + 1);
+    memcpy(&r->chars[r->size], s, n);
+    r->size += n;
+    if (nl && r->size > 0 && r->chars[r->size - 1] == '\r')
+      r->size--;
+    r->chars[r->size] = '\0';
+    update_row(r);
+    *open_line = (nl == NULL);
+    s = nl ? nl + 1 : end;
+  }
+
+  int lines = 0;
+  for (const char *p = s; p < end && (p = memchr(p, '\n', end - p)); p++)
+    lines++;
+  if (s < end && end[-1] != '\n')
+    lines++;
+  if (lines == 0)
+    return;
+
+  E.r = mem_realloc(MEM_ROWS, E.r, sizeof(row) * (E.nrows + lines));
+  change_note(CHANGE_INSERT, E.nrows, E.nrows + lines - 1);
+  while (s < end) {
+    const char *nl = memchr(s, '\n', end - s);
+    size_t n = (nl ? nl : end) - s;
+    *open_line = (nl == NULL);
+    if (nl && n > 0 && s[n - 1] == '\r')
+      n--;
+    row *r = &E.r[E.nrows];
+    r->idx = E.nrows;
+    r->size = n;
+    r->chars = mem_malloc(MEM_CHARS, n + 1);
+    memcpy(r->chars, s, n);
+    r->chars[n] = '\0';
+    r->rsize = 0;
+    r->render = NULL;
+    r->hl = NULL;
+    r->hl_open_comment = 0;
+    r->refs = NULL;
+    r->chunks = NULL;
+    r->gen = E.snaps.gen;
+    r->words = (struct word_row){0, NULL};
+    E.nrows++;
+    wrap_moved(E.nrows - 1);
+    update_row(r);
+    s = nl ? nl + 1 : end;
+  }
+}
+
+// follow mode
+
+/* :follow (or pound -f) keeps the buffer in step with a file that is being
+ * appended to, like tail -f. inotify says when the file changed and only the
+ * bytes past follow.offset are read, at most FOLLOW_READ_MAX per idle tick so
+ * the keyboard stays responsive while a burst is caught up on. a file that
+ * shrinks or is moved/deleted (log rotation) is reopened from the top. */
+#define FOLLOW_READ_MAX (4 * 1024 * 1024)
+
+int follow_watch() {
+  struct follow *f = &E.follow;
+  f->fd = open(E.filename, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (f->fd == -1 || fstat(f->fd, &st) == -1)
+    return -1;
+  f->ino = st.st_ino;
+  // IN_ATTRIB catches the link count dropping when a new file is moved over
+  // ours, which never produces DELETE_SELF while we hold it open
+  f->wd = inotify_add_watch(f->ifd, E.filename,
+                            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                IN_DELETE_SELF);
+  // anything written between loading and watching is picked up right away
+  f->pending = 1;
+  return 0;
+}
+
+void follow_stop() {
+  struct follow *f = &E.follow;
+  if (f->ifd == -1)
+    return;
+  close(f->ifd);
+  if (f->fd != -1)
+    close(f->fd);
+  f->ifd = -1;
+  f->fd = -1;
+}
+
+void follow_start() {
+  struct follow *f = &E.follow;
+  if (E.filename == NULL || E.compress != COMPRESS_NONE) {
+    status_message("follow: only plain files can be followed");
+    return;
+  }
+  f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->ifd == -1 || follow_watch() == -1) {
+    status_message("follow: %s", strerror(errno));
+    follow_stop();
+    return;
+  }
+  f->rotated = 0;
+  if (E.nrows > 0)
+    E.cur.y = E.nrows - 1;
+  status_message("Following %s", E.filename);
+}
+
+// empties the buffer, as before a file is loaded into it
+void clear_rows() {
+  search_hl_drop();
+  if (E.nrows > 0)
+    change_note(CHANGE_DELETE, 0, E.nrows - 1);
+  for (int i = 0; i < E.nrows; i++)
+    free_row(&E.r[i]);
+  mem_free(MEM_ROWS, E.r);
+  E.r = NULL;
+  E.nrows = 0;
+  E.wrap.stale = 1;
+  fold_clear();
+  words_clear(); // built again for what is loaded next
+  E.cur.x = E.cur.y = 0;
+  E.rowoff = 0;
+}
+
+void follow_reopen() {
+  struct follow *f = &E.follow;
+  if (E.dirty) {
+    // reloading would throw the edits away; let the user decide
+    follow_stop();
+    status_message("%s was truncated or replaced; unsaved changes, stopped "
+                   "following",
+                   E.filename);
+    return;
+  }
+  if (f->fd != -1)
+    close(f->fd);
+  f->fd = -1;
+  inotify_rm_watch(f->ifd, f->wd);
+
+  clear_rows();
+  f->offset = 0;
+  f->open_line = 0;
+  E.dirty = 0;
+  journal_reset();
+  // not recreated yet, try again on the next tick
+  f->rotated = (follow_watch() == -1);
+}
+
+int follow_poll() {
+  struct follow *f = &E.follow;
+  if (f->ifd == -1)
+    return 0;
+
+  char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  int events = 0;
+  while ((n = read(f->ifd, ev, sizeof(ev))) > 0) {
+    char *p = ev;
+    while (p < ev + n) {
+      struct inotify_event *e = (struct inotify_event *)p;
+      if (e->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB))
+        events |= IN_ATTRIB;
+      else
+        f->pending = 1;
+      p += sizeof(struct inotify_event) + e->len;
+    }
+  }
+
+  struct stat st;
+  if (events || f->rotated) {
+    // the path now names a different file (or none yet)
+    if (stat(E.filename, &st) == -1)
+      f->rotated = 1;
+    else if (f->rotated || st.st_ino != f->ino) {
+      follow_reopen();
+      return 1;
+    }
+  }
+  if (f->rotated)
+    return 0;
+  if (!f->pending)
+    return 0;
+
+  if (fstat(f->fd, &st) == -1)
+    return 0;
+  if (st.st_size < f->offset) {
+    follow_reopen();
+    return 1;
+  }
+  size_t want = st.st_size - f->offset;
+  f->pending = want > FOLLOW_READ_MAX;
+  if (want == 0)
+    return 0;
+  if (want > FOLLOW_READ_MAX)
+    want = FOLLOW_READ_MAX;
+
+  char *buf = malloc(want);
+  ssize_t got = pread(f->fd, buf, want, f->offset);
+  if (got > 0) {
+    int tail = E.nrows == 0 || E.cur.y >= E.nrows - 1;
+    append_text(buf, got, &f->open_line);
+    f->offset += got;
+    // stick to the bottom like tail -f unless the cursor was moved away
+    if (tail && E.nrows > 0) {
+      E.cur.y = E.nrows - 1;
+      E.cur.x = 0;
+    }
+  }
+  free(buf);
+  return got > 0;
+}
+
+// streaming input
+
+/* `pound -` or `cmd | pound` reads stdin on a thread so the buffer is usable
+ * long before EOF. the reader only moves bytes into a queue; rows are built
+ * on the main thread from editor_idle, STREAM_SLICE_MS at a time, so E.r is
+ * never touched from two threads. keys come from /dev/tty in that case. */
+#define STREAM_CHUNK (1024 * 1024)
+#define STREAM_QUEUE_MAX (64 * 1024 * 1024)
+#define STREAM_SLICE_MS 30
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void editor_wake() {
+  char c = 0;
+  write(E.wake[1], &c, 1);
+}
+
+// producer side: hands a filled chunk over, waiting while the main thread is
+// too far behind so a fast pipe can't balloon memory
+void stream_enqueue(struct stream *st, struct chunk *ck) {
+  pthread_mutex_lock(&st->lock);
+  while (st->queued > STREAM_QUEUE_MAX)
+    pthread_cond_wait(&st->drained, &st->lock);
+  ck->next = NULL;
+  if (st->tail)
+    st->tail->next = ck;
+  else
+    st->head = ck;
+  st->tail = ck;
+  st->queued += ck->len;
+  pthread_mutex_unlock(&st->lock);
+  editor_wake();
+}
+
+void stream_finish(struct stream *st, int err) {
+  pthread_mutex_lock(&st->lock);
+  st->eof = 1;
+  st->err = err;
+  pthread_mutex_unlock(&st->lock);
+  editor_wake();
+}
+
+void *stream_reader(void *arg) {
+  struct stream *st = arg;
+  while (1) {
+    struct chunk *ck = malloc(sizeof(struct chunk) + STREAM_CHUNK);
+    ssize_t n = read(st->fd, ck->data, STREAM_CHUNK);
+    if (n <= 0) {
+      free(ck);
+      stream_finish(st, n < 0 ? errno : 0);
+      return NULL;
+    }
+    ck->len = n;
+    stream_enqueue(st, ck);
+  }
+}
+
+void stream_start(int fd, void *(*producer)(void *)) {
+  struct stream *st = &E.stream;
+  st->fd = fd;
+  st->head = st->tail = NULL;
+  st->queued = st->bytes = 0;
+  st->eof = st->err = 0;
+  st->open_line = 0;
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_cond_init(&st->drained, NULL);
+  st->active = 1;
+  pthread_create(&st->thread, NULL, producer, st);
+}
+
+// consumer side, on the main thread
+int stream_poll() {
+  struct stream *st = &E.stream;
+  if (!st->active)
+    return 0;
+
+  double deadline = now_ms() + STREAM_SLICE_MS;
+  int changed = 0, more = 0;
+  while (now_ms() < deadline) {
+    pthread_mutex_lock(&st->lock);
+    struct chunk *ck = st->head;
+    if (ck) {
+      st->head = ck->next;
+      if (st->head == NULL)
+        st->tail = NULL;
+      st->queued -= ck->len;
+      pthread_cond_signal(&st->drained);
+    }
+    int eof = st->eof;
+    more = st->head != NULL;
+    pthread_mutex_unlock(&st->lock);
+
+    if (ck == NULL) {
+      if (eof) {
+        pthread_join(st->thread, NULL);
+        st->active = 0;
+        if (st->err)
+          status_message("Read error: %s; saving asks for a new name",
+                         strerror(st->err));
+        else if (E.filename)
+          journal_open();
+        return IDLE_REDRAW;
+      }
+      break;
+    }
+    append_text(ck->data, ck->len, &st->open_line);
+    st->bytes += ck->len;
+    free(ck);
+    changed = IDLE_REDRAW;
+  }
+  return changed | (more ? IDLE_BUSY : 0);
+}
+
+// compressed files
+
+/* .gz / .zst files are recognised by their magic bytes and inflated on a
+ * stream producer thread, so decompression runs alongside the main thread
+ * splitting the output into rows. save() compresses again with the same
+ * format. zstd support is optional: build with ZSTD=1. */
+int detect_compression(int fd) {
+  unsigned char m[4];
+  ssize_t n = pread(fd, m, sizeof(m), 0);
+  if (n >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+    return COMPRESS_GZIP;
+  if (n == 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd)
+    return COMPRESS_ZSTD;
+  return COMPRESS_NONE;
+}
+
+void *gzip_reader(void *arg) {
+  struct stream *st = arg;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // 15 + 32: accept both gzip and zlib headers
+  if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+    stream_finish(st, ENOMEM);
+    return NULL;
+  }
+  unsigned char *in = malloc(STREAM_CHUNK);
+  int err = 0, members = 0, eof = 0, ended = 0;
+  while (1) {
+    if (zs.avail_in == 0 && !eof) {
+      ssize_t n = read(st->fd, in, STREAM_CHUNK);
+      if (n < 0) {
+        err = errno;
+        break;
+      }
+      eof = (n == 0);
+      zs.next_in = in;
+      zs.avail_in = n;
+    }
+    if (eof && zs.avail_in == 0 && ended)
+      break;
+    struct chunk *ck = malloc(sizeof(struct chunk) + STREAM_CHUNK);
+    zs.next_out = (unsigned char *)ck->data;
+    zs.avail_out = STREAM_CHUNK;
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    ck->len = STREAM_CHUNK - zs.avail_out;
+    size_t produced = ck->len;
+    if (ck->len)
+      stream_enqueue(st, ck);
+    else
+      free(ck);
+    if (ret == Z_STREAM_END) {
+      // rotated logs are often several gzip members back to back
+      members++;
+      ended = 1;
+      inflateReset(&zs);
+      continue;
+    }
+    if (ret == Z_DATA_ERROR && members > 0 && ended)
+      break; // padding after the last member
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      err = EIO;
+      break;
+    }
+    ended = 0;
+    // input is used up and inflate has nothing left to give: the file was
+    // cut off in the middle of a member
+    if (eof && zs.avail_in == 0 && produced == 0) {
+      err = EIO;
+      break;
+    }
+  }
+  inflateEnd(&zs);
+  free(in);
+  close(st->fd);
+  stream_finish(st, err);
+  return NULL;
+}
+
+#ifdef POUND_ZSTD
+void *zstd_reader(void *arg) {
+  struct stream *st = arg;
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  size_t inlen = ZSTD_DStreamInSize();
+  char *in = malloc(inlen);
+  ZSTD_inBuffer zin = {in, 0, 0};
+  int err = 0, eof = 0, done = 0;
+  while (1) {
+    if (zin.pos == zin.size && !eof) {
+      ssize_t n = read(st->fd, in, inlen);
+      if (n < 0) {
+        err = errno;
+        break;
+      }
+      eof = (n == 0);
+      zin.size = n;
+      zin.pos = 0;
+    }
+    struct chunk *ck = malloc(sizeof(struct chunk) + STREAM_CHUNK);
+    ZSTD_outBuffer zout = {ck->data, STREAM_CHUNK, 0};
+    size_t consumed = zin.pos;
+    size_t ret = ZSTD_decompressStream(dctx, &zout, &zin);
+    ck->len = zout.pos;
+    size_t produced = ck->len;
+    if (ck->len)
+      stream_enqueue(st, ck);
+    else
+      free(ck);
+    if (ZSTD_isError(ret)) {
+      err = EIO;
+      break;
+    }
+    // ret == 0 means the last frame is complete and fully flushed
+    if (produced || zin.pos != consumed)
+      done = (ret == 0);
+    // at EOF keep draining until the decoder has nothing more to flush;
+    // ending anywhere but on a frame boundary means a truncated file
+    if (eof && zin.pos == zin.size && produced == 0) {
+      if (!done)
+        err = EIO;
+      break;
+    }
+  }
+  ZSTD_freeDCtx(dctx);
+  free(in);
+  close(st->fd);
+  stream_finish(st, err);
+  return NULL;
+}
+#endif
+
+// returns 1 if fd was taken over by a decompressing stream
+int open_compressed(int fd) {
+  E.compress = detect_compression(fd);
+  if (E.compress == COMPRESS_GZIP) {
+    stream_start(fd, gzip_reader);
+    return 1;
+  }
+#ifdef POUND_ZSTD
+  if (E.compress == COMPRESS_ZSTD) {
+    stream_start(fd, zstd_reader);
+    return 1;
+  }
+#endif
+  if (E.compress == COMPRESS_ZSTD) {
+    status_message("Built without zstd support (make ZSTD=1)");
+    E.compress = COMPRESS_NONE;
+  }
+  return 0;
+}
+
+// compresses buf in the format the file was opened with; NULL on failure
+char *compress_buffer(char *buf, int len, int *outlen) {
+  if (E.compress == COMPRESS_GZIP) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return NULL;
+    uLong bound = deflateBound(&zs, len);
+    char *out = malloc(bound);
+    zs.next_in = (unsigned char *)buf;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char *)out;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    *outlen = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+      free(out);
+      return NULL;
+    }
+    return out;
+  }
+#ifdef POUND_ZSTD
+  if (E.compress == COMPRESS_ZSTD) {
+    size_t bound = ZSTD_compressBound(len);
+    char *out = malloc(bound);
+    size_t ret = ZSTD_compress(out, bound, buf, len, 3);
+    if (ZSTD_isError(ret)) {
+      free(out);
+      return NULL;
+    }
+    *outlen = ret;
+    return out;
+  }
+#endif
+  return NULL;
+}
+
+// hex view
+
+/* :hex and pound -x show the file on disk rather than the rows: offset, hex
+ * and ASCII columns, HEX_COLS bytes a line. nothing is read up front; only a
+ * window of the file around the screen is mapped, and it is moved along as
+ * the view scrolls, so only the pages on screen are ever touched and a core
+ * dump of many GB opens at once. typed bytes overwrite the file in place
+ * with pwrite, which the shared mapping shows right away. */
+#define HEX_COLS 16
+#define HEX_WINDOW (1 << 20)
+
+int hex_open(const char *filename) {
+  struct hex *h = &E.hex;
+  int fd = open(filename, O_RDWR | O_CLOEXEC);
+  h->writable = fd != -1;
+  if (fd == -1)
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    status_message("Can't open %s: %s", filename, strerror(errno));
+    return -1;
+  }
+  h->fd = fd;
+  h->on = 1;
+  h->size = h->top = h->cur = 0;
+  h->ascii = h->nibble = h->wrote = h->buffer = 0;
+  E.mode = NORMAL;
+  return 0;
+}
+
+void hex_unmap() {
+  struct hex *h = &E.hex;
+  if (h->map)
+    munmap(h->map, h->map_len);
+  h->map = NULL;
+  h->map_len = 0;
+}
+
+void hex_close() {
+  struct hex *h = &E.hex;
+  hex_unmap();
+  close(h->fd);
+  h->fd = -1;
+  h->on = 0;
+  E.mode = NORMAL;
+}
+
+// scrolls to the cursor and maps the part of the file on screen
+void hex_window() {
+  struct hex *h = &E.hex;
+  struct stat st;
+  // mapping past the end of a file that shrank would fault
+  if (fstat(h->fd, &st) == 0 && st.st_size != h->size) {
+    hex_unmap();
+    h->size = st.st_size;
+  }
+  if (h->cur >= h->size)
+    h->cur = h->size > 0 ? h->size - 1 : 0;
+  off_t page = (off_t)E.ws.rows * HEX_COLS;
+  off_t line = h->cur - h->cur % HEX_COLS;
+  if (line < h->top)
+    h->top = line;
+  if (line >= h->top + page)
+    h->top = line - page + HEX_COLS;
+
+  off_t end = h->top + page < h->size ? h->top + page : h->size;
+  if (h->size == 0 || (h->map && h->top >= h->map_off &&
+                       end <= h->map_off + (off_t)h->map_len))
+    return;
+  hex_unmap();
+  // two windows from the one top is in always cover the screen
+  off_t off = h->top - h->top % HEX_WINDOW;
+  size_t len = 2 * HEX_WINDOW;
+  if (h->size - off < (off_t)len)
+    len = h->size - off;
+  void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, h->fd, off);
+  if (p == MAP_FAILED) {
+    status_message("mmap: %s", strerror(errno));
+    return;
+  }
+  madvise(p, len, MADV_RANDOM);
+  h->map = p;
+  h->map_off = off;
+  h->map_len = len;
+}
+
+int hex_digits() {
+  int digits = 8;
+  while (digits < 16 && E.hex.size >> (digits * 4) > 0)
+    digits += 2;
+  return digits;
+}
+
+void hex_draw(struct buffer *b) {
+  struct hex *h = &E.hex;
+  hex_window();
+  int digits = hex_digits();
+  for (int y = 0; y < E.ws.rows; y++) {
+    off_t off = h->top + (off_t)y * HEX_COLS;
+    if (h->map && off < h->size) {
+      unsigned char *p = h->map + (off - h->map_off);
+      int n = h->size - off < HEX_COLS ? h->size - off : HEX_COLS;
+      int here = h->cur >= off && h->cur < off + n ? h->cur - off : -1;
+      char s[64];
+      int len = snprintf(s, sizeof(s), "%s%0*llx\x1b[0m  ",
+                         here != -1 ? "\x1b[37m" : "\x1b[30m", digits,
+                         (unsigned long long)off);
+      buffer_append(b, s, len);
+      for (int i = 0; i < HEX_COLS; i++) {
+        if (i == HEX_COLS / 2)
+          buffer_append(b, " ", 1);
+        if (i >= n) {
+          buffer_append(b, "   ", 3);
+          continue;
+        }
+        // the byte under the cursor shows in the column it isn't in
+        int mark = i == here && h->ascii;
+        len = snprintf(s, sizeof(s), "%s%02x\x1b[0m ",
+                       mark ? "\x1b[7m" : p[i] ? "" : "\x1b[30m", p[i]);
+        buffer_append(b, s, len);
+      }
+      buffer_append(b, " ", 1);
+      for (int i = 0; i < n; i++) {
+        int mark = i == here && !h->ascii;
+        int shown = isprint(p[i]);
+        len = snprintf(s, sizeof(s), "%s%c\x1b[0m",
+                       mark ? "\x1b[7m" : shown ? "" : "\x1b[30m",
+                       shown ? p[i] : '.');
+        buffer_append(b, s, len);
+      }
+    } else if (y == 0 && h->size == 0) {
+      buffer_append(b, "(empty file)", 12);
+    }
+    buffer_append(b, "\x1b[K", 3);
+    buffer_append(b, "\r\n", 2);
+  }
+}
+
+// where the terminal cursor goes, 1-based
+void hex_cursor(int *y, int *x) {
+  struct hex *h = &E.hex;
+  int i = h->cur % HEX_COLS;
+  *y = (h->cur - h->top) / HEX_COLS + 2;
+  if (h->ascii)
+    *x = hex_digits() + 2 + HEX_COLS * 3 + 2 + i + 1;
+  else
+    *x = hex_digits() + 2 + i * 3 + (i >= HEX_COLS / 2) + h->nibble + 1;
+}
+
+void hex_move(off_t by) {
+  struct hex *h = &E.hex;
+  off_t to = h->cur + by;
+  if (to >= h->size)
+    to = h->size - 1;
+  h->cur = to < 0 ? 0 : to;
+  h->nibble = 0;
+}
+
+// overwrites (half) the byte under the cursor with what c stands for
+void hex_type(int c) {
+  struct hex *h = &E.hex;
+  unsigned char byte;
+  if (h->cur >= h->size || pread(h->fd, &byte, 1, h->cur) != 1)
+    return;
+  if (h->ascii) {
+    byte = c;
+  } else {
+    if (!isxdigit(c))
+      return;
+    int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    byte = h->nibble ? (byte & 0xf0) | v : (byte & 0x0f) | v << 4;
+  }
+  if (pwrite(h->fd, &byte, 1, h->cur) != 1) {
+    status_message("Can't write: %s", strerror(errno));
+    return;
+  }
+  h->wrote = 1;
+  if (h->ascii || h->nibble)
+    hex_move(1);
+  else
+    h->nibble = 1;
+}
+
+// :hex, in and out of the view of the buffer's file
+void hex_toggle() {
+  struct hex *h = &E.hex;
+  if (!h->on) {
+    if (E.filename == NULL || E.stream.active) {
+      status_message("No file to show");
+    } else if (E.dirty) {
+      status_message("No write since last change");
+    } else if (hex_open(E.filename) == 0) {
+      h->buffer = 1;
+      // on the byte the cursor was on, as far as the rows can tell
+      if (E.cur.y < E.nrows && !E.compress) {
+        for (int i = 0; i < E.cur.y; i++)
+          h->cur += E.r[i].size + 1;
+        int size = E.r[E.cur.y].size;
+        h->cur += E.cur.x < size ? E.cur.x : size > 0 ? size - 1 : 0;
+      }
+    }
+    return;
+  }
+  int reload = !h->buffer || h->wrote;
+  int buffer = h->buffer;
+  hex_close();
+  if (!reload)
+    return;
+  // the rows are read again from what is now on disk
+  if (buffer) {
+    journal_close();
+    clear_rows();
+  }
+  editor_open(strdup(E.filename));
+}
+
+void on_keypress_hex() {
+  struct hex *h = &E.hex;
+  int c = read_key();
+  // in insert mode everything but the keys that move is a byte to write
+  if (E.mode == INSERT && c < 256 && c != '\x1b' && c != '\t' &&
+      c != BACKSPACE && c != CTRL_KEY('x')) {
+    hex_type(c);
+    return;
+  }
+  switch (c) {
+  case CTRL_KEY('x'):
+    quit_editor();
+    break;
+  case '\x1b':
+    E.mode = NORMAL;
+    h->nibble = 0;
+    break;
+  case 'i':
+  case 'R':
+    if (h->writable)
+      E.mode = INSERT;
+    else
+      status_message("%s is read-only", E.filename);
+    break;
+  case '\t':
+    h->ascii = !h->ascii;
+    h->nibble = 0;
+    break;
+  case 'h':
+  case ARROW_LEFT:
+  case BACKSPACE:
+    hex_move(-1);
+    break;
+  case 'l':
+  case ARROW_RIGHT:
+    hex_move(1);
+    break;
+  case 'j':
+  case ARROW_DOWN:
+    hex_move(HEX_COLS);
+    break;
+  case 'k':
+  case ARROW_UP:
+    hex_move(-HEX_COLS);
+    break;
+  case PAGE_DOWN:
+    hex_move((off_t)E.ws.rows * HEX_COLS);
+    break;
+  case PAGE_UP:
+    hex_move(-(off_t)E.ws.rows * HEX_COLS);
+    break;
+  case '0':
+  case HOME_KEY:
+    hex_move(-(h->cur % HEX_COLS));
+    break;
+  case '$':
+  case END_KEY:
+    hex_move(HEX_COLS - 1 - h->cur % HEX_COLS);
+    break;
+  case 'g':
+    hex_move(-h->cur);
+    break;
+  case 'G':
+    hex_move(h->size);
+    break;
+  case ':':
+    vim_prompt();
+    break;
+  }
+}
+
+// diff
+
+/* :diff compares the buffer with the file on disk and marks rows in the
+ * gutter: + added, ~ changed, - where rows were removed above. every row
+ * keeps a 64 bit hash of its text, dropped whenever the text changes, so a
+ * run only hashes the rows edited since the last one, and the file is only
+ * read again once it was saved or changed under us. a worker thread cuts off
+ * the head and tail the two have in common and runs Myers' greedy algorithm
+ * over the hashes in between, falling back to pairing up unique lines first
+ * when they are far apart. the change feed marks the result stale, and a new
+ * run starts as soon as the previous one is in. */
+#define DIFF_MAX_D 2048 // edits Myers looks for before giving up
+
+uint64_t text_hash(const char *s, int n) {
+  uint64_t h = 0xcbf29ce484222325ull ^ n; // FNV-1a, a word at a time
+  uint64_t w;
+  for (; n >= 8; s += 8, n -= 8) {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0x100000001b3ull;
+    h ^= h >> 29;
+  }
+  for (; n > 0; s++, n--)
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ull;
+  return h ? h : 1; // 0 means not hashed yet
+}
+
+uint64_t row_hash(row *r) {
+  if (r->hash == 0)
+    r->hash = text_hash(r->chars, r->size);
+  return r->hash;
+}
+
+// hashes the lines of the file, split the way loading splits them, unless
+// it is the same file as last time
+int diff_read(struct diff *df) {
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  int fd = open(df->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno != ENOENT)
+    return errno;
+  // a file that was never saved counts as empty: every row is new
+  if (fd != -1 && fstat(fd, &st) == -1) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  int same = df->disk && st.st_ino == df->st.st_ino &&
+             st.st_size == df->st.st_size &&
+             st.st_mtim.tv_sec == df->st.st_mtim.tv_sec &&
+             st.st_mtim.tv_nsec == df->st.st_mtim.tv_nsec;
+  if (same || st.st_size == 0) {
+    if (fd != -1)
+      close(fd);
+    if (!same)
+      df->ndisk = 0;
+    df->st = st;
+    return 0;
+  }
+  char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return errno;
+  df->st = st;
+  df->ndisk = 0;
+  int cap = 0;
+  const char *p = data, *end = data + st.st_size;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *stop = nl ? nl : end;
+    size_t n = stop - p;
+    if (nl && n > 0 && p[n - 1] == '\r')
+      n--;
+    if (df->ndisk == cap) {
+      cap = cap ? cap * 2 : 1024;
+      df->disk = mem_realloc(MEM_META, df->disk, sizeof(uint64_t) * cap);
+    }
+    df->disk[df->ndisk++] = text_hash(p, n);
+    p = stop + 1;
+  }
+  munmap(data, st.st_size);
+  return 0;
+}
+
+// marks on b the rows of the shortest edit script turning a into b: ins[y]
+// for an inserted b[y], del[y] counts the lines of a removed in front of it.
+// 0 if that takes more than max edits
+int diff_myers(const uint64_t *a, int n, const uint64_t *b, int m,
+               unsigned char *ins, int *del, int max) {
+  if (max > n + m)
+    max = n + m;
+  // v[k] is how far along a the furthest path on diagonal k = x - y got; it
+  // is kept for every d, at trace + d * d, to walk the path back
+  int off = max + 1;
+  int *v = malloc(sizeof(int) * (2 * max + 3));
+  int *trace = NULL;
+  size_t cap = 0;
+  int d, x, y;
+  v[off + 1] = 0;
+  for (d = 0; d <= max; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1]))
+        x = v[off + k + 1];
+      else
+        x = v[off + k - 1] + 1;
+      y = x - k;
+      while (x < n && y < m && a[x] == b[y])
+        x++, y++;
+      v[off + k] = x;
+      if (x >= n && y >= m)
+        goto found;
+    }
+    size_t need = (size_t)(d + 1) * (d + 1);
+    if (need > cap) {
+      cap = need * 2;
+      trace = realloc(trace, sizeof(int) * cap);
+    }
+    memcpy(&trace[(size_t)d * d], &v[off - d], sizeof(int) * (2 * d + 1));
+  }
+  free(v);
+  free(trace);
+  return 0;
+
+found:
+  x = n;
+  y = m;
+  for (; d > 0; d--) {
+    // the round before, over diagonals -(d - 1)..d - 1
+    int *prev = &trace[(size_t)(d - 1) * (d - 1)] + (d - 1);
+    int k = x - y, pk;
+    if (k == -d || (k != d && prev[k - 1] < prev[k + 1]))
+      pk = k + 1;
+    else
+      pk = k - 1;
+    int px = prev[pk], py = px - pk;
+    if (pk == k + 1)
+      ins[py] = 1;
+    else
+      del[py]++;
+    x = px;
+    y = py;
+  }
+  free(v);
+  free(trace);
+  return 1;
+}
+
+// for when a and b are too far apart for diff_myers: the lines that occur
+// once in each are paired up, the longest run of pairs in the same order
+// on both sides is kept (patience sorting), and Myers only looks at the
+// gaps between them. a gap that is still too much is one change
+void diff_anchored(const uint64_t *a, int n, const uint64_t *b, int m,
+                   unsigned char *ins, int *del) {
+  struct slot {
+    uint64_t h;
+    int na, nb, at; // times seen in a and in b, where in a
+  };
+  int bits = 1;
+  while ((1 << bits) < 2 * (n + m))
+    bits++;
+  int size = 1 << bits;
+  struct slot *t = calloc(size, sizeof(struct slot));
+  for (int i = 0; i < n + m; i++) {
+    uint64_t h = i < n ? a[i] : b[i - n];
+    int s = (h * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+    while (t[s].h && t[s].h != h)
+      s = (s + 1) & (size - 1);
+    t[s].h = h;
+    if (i < n) {
+      t[s].na++;
+      t[s].at = i;
+    } else {
+      t[s].nb++;
+    }
+  }
+  // pairs in b order; pile[] holds the pair ending the best run of each
+  // length, prev[] the one before it in that run
+  int *x = malloc(sizeof(int) * (m + 1));
+  int *y = malloc(sizeof(int) * (m + 1));
+  int *pile = malloc(sizeof(int) * (m + 1));
+  int *prev = malloc(sizeof(int) * (m + 1));
+  int np = 0, piles = 0;
+  for (int j = 0; j < m; j++) {
+    int s = (b[j] * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+    while (t[s].h != b[j])
+      s = (s + 1) & (size - 1);
+    if (t[s].na != 1 || t[s].nb != 1)
+      continue;
+    x[np] = t[s].at;
+    y[np] = j;
+    int lo = 0, hi = piles;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (x[pile[mid]] < x[np])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    prev[np] = lo ? pile[lo - 1] : -1;
+    pile[lo] = np;
+    if (lo == piles)
+      piles++;
+    np++;
+  }
+  free(t);
+  // walked back from the end, with the ends of a and b as the last anchor
+  int a1 = n, b1 = m;
+  for (int p = piles ? pile[piles - 1] : -1;; p = prev[p]) {
+    int a0 = p >= 0 ? x[p] + 1 : 0, b0 = p >= 0 ? y[p] + 1 : 0;
+    if (!diff_myers(a + a0, a1 - a0, b + b0, b1 - b0, ins + b0, del + b0,
+                    DIFF_MAX_D)) {
+      memset(ins + b0, 1, b1 - b0);
+      del[b0] += a1 - a0;
+    }
+    if (p < 0)
+      break;
+    a1 = x[p];
+    b1 = y[p];
+  }
+  free(x);
+  free(y);
+  free(pile);
+  free(prev);
+}
+
+void *diff_worker(void *arg) {
+  struct diff *df = arg;
+  df->err = diff_read(df);
+  if (df->err) {
+    __atomic_store_n(&df->done, 1, __ATOMIC_RELEASE);
+    editor_wake();
+    return NULL;
+  }
+  const uint64_t *a = df->disk, *b = df->rows;
+  int n = df->ndisk, m = df->nrows;
+  int head = 0;
+  while (head < n && head < m && a[head] == b[head])
+    head++;
+  int tail = 0;
+  while (tail < n - head && tail < m - head &&
+         a[n - 1 - tail] == b[m - 1 - tail])
+    tail++;
+  n -= head + tail;
+  m -= head + tail;
+
+  unsigned char *ins = calloc(m + 1, 1);
+  int *del = calloc(m + 1, sizeof(int));
+  if (!diff_myers(a + head, n, b + head, m, ins, del, DIFF_MAX_D))
+    diff_anchored(a + head, n, b + head, m, ins, del);
+
+  // a run of inserted rows and the lines removed among them make a hunk:
+  // as many rows as were removed count as changed, the rest as added, and
+  // removed lines left over are marked on the row after it
+  unsigned char *mk = df->next;
+  memset(mk, DIFF_SAME, df->nrows);
+  df->added = df->changed = df->removed = 0;
+  for (int y = 0; y <= m;) {
+    if (!ins[y] && del[y] == 0) {
+      y++;
+      continue;
+    }
+    int end = y, dels = 0;
+    for (; end < m && ins[end]; end++)
+      dels += del[end];
+    dels += del[end];
+    int changed = dels < end - y ? dels : end - y;
+    for (int i = y; i < end; i++)
+      mk[head + i] = i - y < changed ? DIFF_CHANGE : DIFF_ADD;
+    if (dels > changed) {
+      if (head + end < df->nrows)
+        mk[head + end] = DIFF_DEL;
+      else if (head + end > 0 && mk[head + end - 1] == DIFF_SAME)
+        mk[head + end - 1] = DIFF_DEL_BELOW;
+    }
+    df->changed += changed;
+    df->added += end - y - changed;
+    df->removed += dels - changed;
+    y = end + 1;
+  }
+  free(ins);
+  free(del);
+  __atomic_store_n(&df->done, 1, __ATOMIC_RELEASE);
+  editor_wake();
+  return NULL;
+}
+
+// hands the rows as they are now to a new run
+void diff_start() {
+  struct diff *df = &E.diff;
+  df->rows = mem_realloc(MEM_META, df->rows, sizeof(uint64_t) * (E.nrows + 1));
+  df->next = mem_realloc(MEM_META, df->next, E.nrows + 1);
+  for (int i = 0; i < E.nrows; i++)
+    df->rows[i] = row_hash(&E.r[i]);
+  df->nrows = E.nrows;
+  df->stale = 0;
+  df->done = 0;
+  df->running = 1;
+  pthread_create(&df->thread, NULL, diff_worker, df);
+}
+
+void diff_stop() {
+  struct diff *df = &E.diff;
+  if (df->running)
+    pthread_join(df->thread, NULL);
+  df->running = 0;
+  df->on = 0;
+  df->built++;
+  mem_free(MEM_META, df->disk);
+  mem_free(MEM_META, df->rows);
+  mem_free(MEM_META, df->marks);
+  mem_free(MEM_META, df->next);
+  free(df->path);
+  df->disk = df->rows = NULL;
+  df->marks = df->next = NULL;
+  df->path = NULL;
+  df->nmarks = 0;
+}
+
+// picks up a finished run and starts the next one if rows changed since
+int diff_poll() {
+  struct diff *df = &E.diff;
+  if (!df->on)
+    return 0;
+  int flags = 0;
+  if (df->running) {
+    if (!__atomic_load_n(&df->done, __ATOMIC_ACQUIRE))
+      return 0;
+    pthread_join(df->thread, NULL);
+    df->running = 0;
+    if (df->err) {
+      status_message("Can't diff: %s", strerror(df->err));
+      diff_stop();
+      return IDLE_REDRAW;
+    }
+    // the screen is only drawn again if a marker changed
+    if (df->nmarks != df->nrows ||
+        memcmp(df->marks, df->next, df->nrows) != 0) {
+      unsigned char *t = df->marks;
+      df->marks = df->next;
+      df->next = t;
+      df->nmarks = df->nrows;
+      df->built++;
+      flags = IDLE_REDRAW;
+    }
+    if (df->tell) {
+      status_message("%d added, %d changed, %d removed", df->added,
+                     df->changed, df->removed);
+      df->tell = 0;
+      flags = IDLE_REDRAW;
+    }
+  }
+  if (df->stale)
+    diff_start();
+  return flags;
+}
+
+// the DIFF_* marker for row y
+int diff_mark(int y) {
+  struct diff *df = &E.diff;
+  return df->on && y < df->nmarks ? df->marks[y] : DIFF_SAME;
+}
+
+void diff_changed(const struct change *ch) {
+  (void)ch;
+  E.diff.stale = 1;
+}
+
+void diff_toggle() {
+  struct diff *df = &E.diff;
+  if (df->on) {
+    diff_stop();
+    status_message("Diff off");
+    return;
+  }
+  if (E.filename == NULL || E.compress != COMPRESS_NONE || E.stream.active) {
+    status_message(E.filename == NULL ? "No file to compare with"
+                                      : "Can't diff a compressed file");
+    return;
+  }
+  df->on = 1;
+  df->tell = 1;
+  df->path = strdup(E.filename);
+  diff_start();
+}
+
+/* a file is read-only while it is still being decompressed: its journal is
+ * only opened (and possibly replayed) once the whole file is in, so edits
+ * made before that could neither be journaled nor combined with a replay */
+int editable() {
+  if (E.stream.active && E.filename) {
+    status_message("Still loading, read-only until done");
+    return 0;
+  }
+  return 1;
+}
+
+// runs whenever read_key is waiting for input; see IDLE_* for the result
+int editor_idle() {
+  int flags = 0;
+  journal_tick();
+  if (follow_poll())
+    flags |= IDLE_REDRAW;
+  flags |= stream_poll();
+  flags |= diff_poll();
+  flags |= save_poll();
+  flags |= words_poll();
+  return flags;
+}
+
+// deletes whole rows lo..hi into the register
+void normal_delete_rows(int lo, int hi) {
+  if (lo >= E.nrows)
+    return;
+  if (hi >= E.nrows)
+    hi = E.nrows - 1;
+  struct cursor start = {0, lo}, end = {0, hi};
+  reg_yank(start, end, 1);
+  delete_rows(lo, hi - lo + 1);
+  E.cur.y = lo < E.nrows ? lo : E.nrows - 1;
+  if (E.cur.y < 0)
+    E.cur.y = 0;
+  E.cur.x = 0;
+  if (hi > lo)
+    status_message("%d fewer lines", hi - lo + 1);
+  else
+    status_message("");
+}
+
+void normal_d() {
+  int count = E.count ? E.count : 1;
+  E.count = 0;
+  int c = read_key();
+  switch (c) {
+  case 'd':
+    normal_delete_rows(E.cur.y, E.cur.y + count - 1);
+    break;
+  case 'G':
+    normal_delete_rows(E.cur.y, E.nrows - 1);
+    break;
+  case 'g':
+    if (read_key() == 'g') {
+      normal_delete_rows(0, E.cur.y);
+      break;
+    }
+    E.regname = 0;
+    status_message("dg is undefined");
+    break;
+  default:
+    E.regname = 0;
+    status_message("%c is undefined", c);
+    break;
+  }
+}
+
+void normal_y() {
+  int c = read_key();
+  switch (c) {
+  case 'y':
+    if (E.cur.y < E.nrows)
+      reg_yank(E.cur, E.cur, 1);
+    break;
+  default:
+    E.regname = 0;
+    status_message("%c is undefined", c);
+    break;
+  }
+}
+
+// "x picks the register the next yank, delete or put uses
+void pick_register() {
+  int c = read_key();
+  if ((c >= 'a' && c <= 'z') || c == '+' || c == '"')
+    E.regname = c == '"' ? 0 : c;
+  else
+    status_message("Invalid register");
+}
+
+// ex ranges
+
+/* parses the optional range in front of an ex command: %, N, N,M, with . for
+ * the cursor line and $ for the last one. no range means the cursor line.
+ * rows come back 0-based and inclusive; returns -1 on a bad range. */
+int ex_line(char **p, int *line) {
+  if (**p == '.') {
+    *line = E.cur.y;
+    (*p)++;
+  } else if (**p == '$') {
+    *line = E.nrows - 1;
+    (*p)++;
+  } else if (isdigit(**p)) {
+    *line = strtol(*p, p, 10) - 1;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+int ex_range(char **p, int *lo, int *hi) {
+  *lo = *hi = E.cur.y;
+  if (**p == '%') {
+    (*p)++;
+    *lo = 0;
+    *hi = E.nrows - 1;
+  } else if (ex_line(p, lo)) {
+    *hi = *lo;
+    if (**p == ',') {
+      (*p)++;
+      if (!ex_line(p, hi))
+        return -1;
+    }
+  }
+  if (*lo > *hi) {
+    int t = *lo;
+    *lo = *hi;
+    *hi = t;
+  }
+  if (*lo < 0 || *hi >= E.nrows)
+    return -1;
+  return 0;
+}
+
+// substitute
+
+/* :[range]s/pat/rep/[gi]. patterns without regex metacharacters are matched
+ * with memmem, anything else is a POSIX extended regex; in the replacement &
+ * is the match and \1..\9 are groups. every touched row gets its new text
+ * built in one pass on a worker thread (which also re-renders it), then the
+ * main thread journals it and runs update_syntax once per row. */
+struct substitute {
+  char *pat;
+  char *rep;
+  int global;
+  int icase;
+  int literal;
+  int patlen;
+  int lo;
+  int hi;
+  const uint64_t *only; // if set, rows lo + i without bit i are skipped
+  char **out; // replaced text per row in [lo, hi], NULL if unchanged
+  long *counts; // replacements per worker range start row
+  int error;
+};
+
+void sub_grow(char **b, int *len, int *cap, const char *s, int n) {
+  if (*len + n + 1 > *cap) {
+    while (*len + n + 1 > *cap)
+      *cap = *cap ? *cap * 2 : 64;
+    *b = mem_realloc(MEM_CHARS, *b, *cap);
+  }
+  memcpy(*b + *len, s, n);
+  *len += n;
+}
+
+void sub_expand(struct substitute *sub, const char *line, regmatch_t *m,
+                char **b, int *len, int *cap) {
+  for (const char *r = sub->rep; *r; r++) {
+    if (*r == '&') {
+      sub_grow(b, len, cap, line + m[0].rm_so, m[0].rm_eo - m[0].rm_so);
+    } else if (*r == '\\' && r[1]) {
+      r++;
+      if (*r >= '1' && *r <= '9' && !sub->literal) {
+        regmatch_t *g = &m[*r - '0'];
+        if (g->rm_so != -1)
+          sub_grow(b, len, cap, line + g->rm_so, g->rm_eo - g->rm_so);
+      } else {
+        sub_grow(b, len, cap, r, 1);
+      }
+    } else {
+      sub_grow(b, len, cap, r, 1);
+    }
+  }
+}
+
+void substitute_worker(void *ctx, int lo, int hi) {
+  struct substitute *sub = ctx;
+  regex_t re;
+  // one compiled regex per thread: glibc serialises regexec on a shared one
+  if (!sub->literal &&
+      regcomp(&re, sub->pat, REG_EXTENDED | (sub->icase ? REG_ICASE : 0))) {
+    sub->error = 1;
+    return;
+  }
+  long count = 0;
+  regmatch_t m[10];
+  for (int i = lo; i < hi; i++) {
+    if (sub->only && !(sub->only[i / 64] >> (i % 64) & 1))
+      continue;
+    row *r = &E.r[sub->lo + i];
+    char *b = NULL;
+    int len = 0, cap = 0, at = 0;
+    while (at <= r->size) {
+      if (sub->literal) {
+        char *hit = memmem(r->chars + at, r->size - at, sub->pat, sub->patlen);
+        if (hit == NULL)
+          break;
+        m[0].rm_so = hit - r->chars;
+        m[0].rm_eo = m[0].rm_so + sub->patlen;
+      } else {
+        m[0].rm_so = at;
+        m[0].rm_eo = r->size;
+        if (regexec(&re, r->chars, 10, m,
+                    REG_STARTEND | (at > 0 ? REG_NOTBOL : 0)) != 0)
+          break;
+      }
+      sub_grow(&b, &len, &cap, r->chars + at, m[0].rm_so - at);
+      sub_expand(sub, r->chars, m, &b, &len, &cap);
+      count++;
+      at = m[0].rm_eo;
+      if (m[0].rm_eo == m[0].rm_so) {
+        // empty match: keep one character so the scan moves on
+        if (at < r->size)
+          sub_grow(&b, &len, &cap, r->chars + at, 1);
+        at++;
+      }
+      if (!sub->global)
+        break;
+    }
+    if (b == NULL)
+      continue;
+    if (at < r->size)
+      sub_grow(&b, &len, &cap, r->chars + at, r->size - at);
+    b[len] = '\0';
+    // rows are disjoint between workers, so swapping the text in and
+    // expanding tabs can happen right here; the old text is freed later
+    sub->out[i] = r->chars;
+    r->chars = b;
+    r->size = len;
+    render_row(r);
+  }
+  sub->counts[lo] = count;
+  if (!sub->literal)
+    regfree(&re);
+}
+
+// splits s/pat/rep/flags in place; the delimiter is whatever follows the s.
+// an empty pattern keeps whatever sub->pat already holds
+int parse_substitute(char *p, struct substitute *sub) {
+  char delim = *p;
+  if (delim == '\0' || isalnum(delim) || delim == '\\')
+    return -1;
+  char *field[3] = {p + 1, NULL, NULL};
+  int f = 0;
+  char *w = p + 1;
+  for (char *q = p + 1; *q; q++) {
+    if (*q == '\\' && q[1] == delim) {
+      *w++ = *++q;
+    } else if (*q == delim && f < 2) {
+      *w++ = '\0';
+      field[++f] = w;
+    } else {
+      *w++ = *q;
+    }
+  }
+  *w = '\0';
+  if (field[0][0])
+    sub->pat = field[0];
+  if (f == 0 || sub->pat == NULL)
+    return -1;
+  sub->rep = field[1];
+  sub->global = sub->icase = 0;
+  for (char *fl = field[2]; fl && *fl; fl++) {
+    if (*fl == 'g')
+      sub->global = 1;
+    else if (*fl == 'i')
+      sub->icase = 1;
+    else
+      return -1;
+  }
+  // rows can't hold a line break, so \n can't be produced by a replacement
+  for (char *r = sub->rep; r && *r; r++) {
+    if (*r == '\\' && r[1] == 'n')
+      return -1;
+    if (*r == '\\' && r[1])
+      r++;
+  }
+  sub->patlen = strlen(sub->pat);
+  sub->literal = !sub->icase && strpbrk(sub->pat, ".[]*^$\\+?(){}|") == NULL;
+  return 0;
+}
+
+// only and pat are set when running under :g, see struct global
+void substitute(int lo, int hi, char *args, const uint64_t *only, char *pat) {
+  struct substitute sub;
+  sub.pat = pat;
+  sub.only = only;
+  if (parse_substitute(args, &sub) == -1) {
+    status_message("Usage: :[range]s/pattern/replacement/[gi]");
+    return;
+  }
+  int n = hi - lo + 1;
+  sub.lo = lo;
+  sub.hi = hi;
+  sub.error = 0;
+  sub.out = calloc(n, sizeof(char *));
+  sub.counts = calloc(n, sizeof(long));
+  parallel_for(n, substitute_worker, &sub);
+  if (sub.error) {
+    status_message("Invalid pattern: %s", sub.pat);
+    free(sub.out);
+    free(sub.counts);
+    return;
+  }
+
+  long total = 0;
+  int lines = 0;
+  for (int i = 0; i < n; i++) {
+    total += sub.counts[i];
+    if (sub.out[i] == NULL)
+      continue;
+    row *r = &E.r[lo + i];
+    journal_record(J_SET_ROW, lo + i, 0, r->size, r->chars);
+    update_syntax(r);
+    wrap_update(r);
+    // the worker swapped the text but left the old text's owners alone
+    text_retire(sub.out[i], r->refs, r->gen);
+    r->refs = NULL;
+    r->gen = E.snaps.gen;
+    E.dirty++;
+    E.cur.y = lo + i;
+    lines++;
+  }
+  free(sub.out);
+  free(sub.counts);
+  if (lines == 0) {
+    status_message("Pattern not found: %s", sub.pat);
+    return;
+  }
+  E.cur.x = 0;
+  status_message("%ld substitution%s on %d line%s", total, total == 1 ? "" : "s",
+                 lines, lines == 1 ? "" : "s");
+}
+
+// global
+
+/* :[range]g/pat/cmd runs cmd on every row matching pat, :v (or :g!) on every
+ * row that doesn't; no range means the whole file. rows are matched in
+ * parallel into a bitmap, then d drops them all in one compaction pass and
+ * s only visits them. without a cmd the matches are just counted. */
+struct global {
+  char *pat;
+  int literal;
+  int invert;
+  int lo;
+  int n;
+  uint64_t *bits; // bit i set when row lo + i is selected
+  int error;
+};
+
+void global_worker(void *ctx, int lo, int hi) {
+  struct global *g = ctx;
+  regex_t re;
+  if (!g->literal && regcomp(&re, g->pat, REG_EXTENDED | REG_NOSUB)) {
+    g->error = 1;
+    return;
+  }
+  int patlen = strlen(g->pat);
+  // work is split by bitmap word, so no two workers ever write the same one
+  for (int w = lo; w < hi; w++) {
+    uint64_t word = 0;
+    for (int b = 0; b < 64 && w * 64 + b < g->n; b++) {
+      row *r = &E.r[g->lo + w * 64 + b];
+      int hit;
+      if (g->literal) {
+        hit = memmem(r->chars, r->size, g->pat, patlen) != NULL;
+      } else {
+        regmatch_t m = {0, r->size};
+        hit = regexec(&re, r->chars, 1, &m, REG_STARTEND) == 0;
+      }
+      if (hit != g->invert)
+        word |= (uint64_t)1 << b;
+    }
+    g->bits[w] = word;
+  }
+  if (!g->literal)
+    regfree(&re);
+}
+
+// splits /pat/cmd in place and returns cmd; NULL if there is no pattern
+char *parse_global(char *p, struct global *g) {
+  char delim = *p;
+  if (delim == '\0' || isalnum(delim) || delim == '\\')
+    return NULL;
+  g->pat = p + 1;
+  char *w = p + 1;
+  char *q = p + 1;
+  for (; *q && *q != delim; q++) {
+    if (*q == '\\' && q[1] == delim)
+      q++;
+    *w++ = *q;
+  }
+  char *cmd = *q ? q + 1 : q;
+  *w = '\0';
+  if (g->pat[0] == '\0')
+    return NULL;
+  g->literal = strpbrk(g->pat, ".[]*^$\\+?(){}|") == NULL;
+  return cmd;
+}
+
+void global(int lo, int hi, int invert, char *args) {
+  struct global g;
+  char *cmd = parse_global(args, &g);
+  if (cmd == NULL) {
+    status_message("Usage: :[range]g/pattern/[d|s/pat/rep/]");
+    return;
+  }
+  if (*cmd && strcmp(cmd, "d") != 0 && *cmd != 's') {
+    status_message("Unsupported :g command: %s", cmd);
+    return;
+  }
+  if (*cmd && !editable())
+    return;
+  g.invert = invert;
+  g.lo = lo;
+  g.n = hi - lo + 1;
+  g.error = 0;
+  int words = (g.n + 63) / 64;
+  g.bits = malloc(sizeof(uint64_t) * words);
+  parallel_for_min(words, PARALLEL_MIN / 64, global_worker, &g);
+  if (g.error) {
+    status_message("Invalid pattern: %s", g.pat);
+    free(g.bits);
+    return;
+  }
+  int first = -1, count = 0;
+  for (int w = 0; w < words; w++) {
+    if (g.bits[w] && first == -1)
+      first = lo + w * 64 + __builtin_ctzll(g.bits[w]);
+    count += __builtin_popcountll(g.bits[w]);
+  }
+  if (count == 0) {
+    status_message("Pattern not found: %s", g.pat);
+  } else if (*cmd == '\0') {
+    E.cur.y = first;
+    E.cur.x = 0;
+    status_message("%d matching line%s", count, count == 1 ? "" : "s");
+  } else if (*cmd == 'd') {
+    compact_rows(g.bits, lo, g.n);
+    E.cur.y = first < E.nrows ? first : E.nrows - 1;
+    if (E.cur.y < 0)
+      E.cur.y = 0;
+    E.cur.x = 0;
+    status_message("%d fewer line%s", count, count == 1 ? "" : "s");
+  } else {
+    substitute(lo, hi, cmd + 1, g.bits, g.pat);
+  }
+  free(g.bits);
+}
+
+// sort
+
+/* :[range]sort [nru] sorts rows, by the first number in them with n (rows
+ * without one go first), backwards with r or !, keeping only the first of
+ * rows that compare equal with u. :[range]uniq drops rows equal to the one
+ * above them. no range means the whole file. what gets sorted is a handle
+ * per row: where it is, and the 16 bytes after the prefix every row in the
+ * range shares (or its number), so most comparisons never touch the text.
+ * every core merge sorts a slice of the handles, the slices are merged in
+ * pairs, a round of pairs at a time in parallel, and the rows are moved into
+ * place by following the cycles of the result. the sort is stable, so the
+ * journal keeps just the range and flags and a replay sorts again. */
+enum { SORT_NUMBER = 1, SORT_REVERSE = 2, SORT_UNIQUE = 4 };
+#define SORT_SKIP_MAX 64 // longest shared prefix looked for
+#define SORT_RUN 32      // slices start out as runs this long
+
+struct sort_key {
+  uint64_t pre[2]; // 16 bytes of text from skip on, big endian, or the number
+  int has;         // n: the row has a number
+  int y;
+};
+
+struct sort {
+  int flags; // SORT_*
+  int lo;
+  int n;
+  int skip;
+  struct sort_key *keys; // sorted so far
+  struct sort_key *tmp;
+  int slices; // slice i is [i * n / slices, (i + 1) * n / slices)
+  int width;  // slices per run in the current merge round
+};
+
+int sort_cmp(const struct sort *s, const struct sort_key *a,
+             const struct sort_key *b) {
+  int c;
+  if (s->flags & SORT_NUMBER) {
+    c = a->has != b->has ? a->has - b->has
+                         : (a->pre[0] > b->pre[0]) - (a->pre[0] < b->pre[0]);
+  } else if (a->pre[0] != b->pre[0]) {
+    c = a->pre[0] < b->pre[0] ? -1 : 1;
+  } else if (a->pre[1] != b->pre[1]) {
+    c = a->pre[1] < b->pre[1] ? -1 : 1;
+  } else {
+    row *x = &E.r[a->y], *y = &E.r[b->y];
+    int off = s->skip + 16;
+    int lx = x->size > off ? x->size - off : 0;
+    int ly = y->size > off ? y->size - off : 0;
+    c = memcmp(x->chars + off, y->chars + off, lx < ly ? lx : ly);
+    if (c == 0)
+      c = x->size - y->size;
+  }
+  return s->flags & SORT_REVERSE ? -c : c;
+}
+
+void sort_keys(void *ctx, int lo, int hi) {
+  struct sort *s = ctx;
+  for (int i = lo; i < hi; i++) {
+    struct sort_key *k = &s->keys[i];
+    row *r = &E.r[s->lo + i];
+    k->y = s->lo + i;
+    k->pre[0] = k->pre[1] = 0;
+    k->has = 0;
+    if (s->flags & SORT_NUMBER) {
+      char *d = r->chars;
+      while (*d && !isdigit((unsigned char)*d))
+        d++;
+      if (*d) {
+        if (d > r->chars && d[-1] == '-')
+          d--;
+        // biased, so the numbers order as unsigned
+        k->pre[0] = (uint64_t)strtoll(d, NULL, 10) ^ (1ull << 63);
+        k->has = 1;
+      }
+      continue;
+    }
+    for (int j = 0; j < 16; j++) {
+      int at = s->skip + j;
+      uint64_t *w = &k->pre[j / 8];
+      *w = *w << 8 | (at < r->size ? (unsigned char)r->chars[at] : 0);
+    }
+  }
+}
+
+// merges the sorted src[lo, mid) and src[mid, hi) into dst[lo, hi), ties
+// going to the left so the order of equal rows is kept
+void sort_merge(const struct sort *s, const struct sort_key *src, int lo,
+                int mid, int hi, struct sort_key *dst) {
+  int i = lo, j = mid, k = lo;
+  while (i < mid && j < hi)
+    dst[k++] = sort_cmp(s, &src[j], &src[i]) < 0 ? src[j++] : src[i++];
+  memcpy(&dst[k], &src[i], sizeof(*src) * (mid - i));
+  k += mid - i;
+  memcpy(&dst[k], &src[j], sizeof(*src) * (hi - j));
+}
+
+// sorts whole slices lo..hi - 1 in place in keys, bottom up
+void sort_slices(void *ctx, int lo, int hi) {
+  struct sort *s = ctx;
+  for (int sl = lo; sl < hi; sl++) {
+    int a = (long)sl * s->n / s->slices, b = (long)(sl + 1) * s->n / s->slices;
+    struct sort_key *src = s->keys, *dst = s->tmp;
+    for (int r = a; r < b; r += SORT_RUN) {
+      int end = r + SORT_RUN < b ? r + SORT_RUN : b;
+      for (int i = r + 1; i < end; i++) {
+        struct sort_key k = src[i];
+        int j = i;
+        for (; j > r && sort_cmp(s, &k, &src[j - 1]) < 0; j--)
+          src[j] = src[j - 1];
+        src[j] = k;
+      }
+    }
+    for (int w = SORT_RUN; w < b - a; w *= 2) {
+      for (int r = a; r < b; r += 2 * w) {
+        int mid = r + w < b ? r + w : b;
+        int end = r + 2 * w < b ? r + 2 * w : b;
+        sort_merge(s, src, r, mid, end, dst);
+      }
+      struct sort_key *t = src;
+      src = dst;
+      dst = t;
+    }
+    if (src != s->keys)
+      memcpy(&s->keys[a], &src[a], sizeof(*src) * (b - a));
+  }
+}
+
+// merges runs of s->width slices pairwise from keys into tmp
+void sort_round(void *ctx, int lo, int hi) {
+  struct sort *s = ctx;
+  for (int p = lo; p < hi; p++) {
+    int first = 2 * p * s->width;
+    int mid = first + s->width < s->slices ? first + s->width : s->slices;
+    int last = mid + s->width < s->slices ? mid + s->width : s->slices;
+    sort_merge(s, s->keys, (long)first * s->n / s->slices,
+               (long)mid * s->n / s->slices, (long)last * s->n / s->slices,
+               s->tmp);
+  }
+}
+
+// sorts rows lo..hi; returns the rows u dropped
+int sort_rows(int lo, int hi, int flags) {
+  struct sort s;
+  s.flags = flags;
+  s.lo = lo;
+  s.n = hi - lo + 1;
+  s.skip = 0;
+  if (!(flags & SORT_NUMBER)) {
+    s.skip = E.r[lo].size < SORT_SKIP_MAX ? E.r[lo].size : SORT_SKIP_MAX;
+    for (int i = lo + 1; i <= hi && s.skip > 0; i++) {
+      row *r = &E.r[i];
+      int m = r->size < s.skip ? r->size : s.skip, j = 0;
+      while (j < m && r->chars[j] == E.r[lo].chars[j])
+        j++;
+      s.skip = j;
+    }
+  }
+  s.keys = malloc(sizeof(struct sort_key) * s.n);
+  s.tmp = malloc(sizeof(struct sort_key) * s.n);
+  s.slices = s.n < PARALLEL_MIN ? 1 : nthreads();
+  parallel_for_min(s.n, PARALLEL_MIN, sort_keys, &s);
+  parallel_for_min(s.slices, 1, sort_slices, &s);
+  for (s.width = 1; s.width < s.slices; s.width *= 2) {
+    int pairs = (s.slices + 2 * s.width - 1) / (2 * s.width);
+    parallel_for_min(pairs, 1, sort_round, &s);
+    struct sort_key *t = s.keys;
+    s.keys = s.tmp;
+    s.tmp = t;
+  }
+
+  // with u, a row the one before compares equal to goes afterwards
+  uint64_t *dead = NULL;
+  if (flags & SORT_UNIQUE) {
+    dead = calloc((s.n + 63) / 64, sizeof(uint64_t));
+    for (int i = 1; i < s.n; i++)
+      if (sort_cmp(&s, &s.keys[i - 1], &s.keys[i]) == 0)
+        dead[i / 64] |= 1ull << (i % 64);
+  }
+
+  // highlighting only depends on the rows above through an open comment
+  int open = lo > 0 && E.r[lo - 1].hl_open_comment;
+  for (int i = lo; i <= hi && !open; i++)
+    open = E.r[i].hl_open_comment;
+
+  // keys[i].y is the row that goes to lo + i; each cycle of that is one
+  // row set aside and the rest moved along it
+  struct sort_key *k = s.keys;
+  for (int i = 0; i < s.n; i++) {
+    if (k[i].y < 0)
+      continue;
+    row t = E.r[lo + i];
+    int j = i;
+    while (k[j].y - lo != i) {
+      int from = k[j].y - lo;
+      E.r[lo + j] = E.r[lo + from];
+      k[j].y = -1;
+      j = from;
+    }
+    E.r[lo + j] = t;
+    k[j].y = -1;
+  }
+  for (int i = lo; i <= hi; i++)
+    E.r[i].idx = i;
+  free(s.keys);
+  free(s.tmp);
+  journal_record(J_SORT, lo, flags & ~SORT_UNIQUE, s.n, NULL);
+  wrap_moved(lo);
+  E.dirty++;
+  if (open) {
+    int changed = 0;
+    for (int i = lo; i <= hi; i++)
+      changed = syntax_row(&E.r[i], i > 0 && E.r[i - 1].hl_open_comment);
+    if (changed && hi + 1 < E.nrows)
+      update_syntax(&E.r[hi + 1]);
+  }
+  int removed = 0;
+  if (dead) {
+    removed = compact_rows(dead, lo, s.n);
+    free(dead);
+  }
+  return removed;
+}
+
+// drops rows lo..hi that have the same text as the one above
+int uniq_rows(int lo, int hi) {
+  int n = hi - lo + 1;
+  uint64_t *dead = calloc((n + 63) / 64, sizeof(uint64_t));
+  for (int i = 1; i < n; i++) {
+    row *a = &E.r[lo + i - 1], *b = &E.r[lo + i];
+    if (a->size == b->size && memcmp(a->chars, b->chars, a->size) == 0)
+      dead[i / 64] |= 1ull << (i % 64);
   }
-  E.cur.x = findn(E.nrows) + 1;
-  E.dirty = 0;
-  free(line);
-  fclose(fp);
+  int removed = compact_rows(dead, lo, n);
+  free(dead);
+  return removed;
 }
 
-void normal_d() {
-  int c = read_key();
-  switch (c) {
-  case 'd':
-    del_row(E.cur.y);
-    status_message("");
-    break;
-  default:
-    status_message("%c is undefined", c);
-    break;
+// :sort, :sort!, :sort nru; a range was already taken off args
+void sort_command(int lo, int hi, char *args) {
+  int flags = 0;
+  if (*args == '!') {
+    flags |= SORT_REVERSE;
+    args++;
+  }
+  for (; *args; args++) {
+    if (*args == 'n')
+      flags |= SORT_NUMBER;
+    else if (*args == 'r')
+      flags |= SORT_REVERSE;
+    else if (*args == 'u')
+      flags |= SORT_UNIQUE;
+    else if (*args != ' ') {
+      status_message("Usage: :[range]sort[!] [nru]");
+      return;
+    }
   }
+  if (!editable())
+    return;
+  search_hl_restore();
+  int removed = sort_rows(lo, hi, flags);
+  E.cur.y = lo;
+  E.cur.x = 0;
+  if (removed)
+    status_message("%d lines sorted, %d fewer", hi - lo + 1 - removed, removed);
+  else
+    status_message("%d lines sorted", hi - lo + 1);
 }
 
 void vim_prompt() {
@@ -1252,32 +6300,111 @@ void vim_prompt() {
     status_message("Command aborted");
     return;
   }
-  // check if cmd is a number
-  if (isdigit(cmd[0])) {
+  char *p = cmd;
+  int lo, hi;
+  int range = ex_range(&p, &lo, &hi);
+  int ranged = p != cmd;
+  if (E.hex.on && isdigit(cmd[0])) {
+    // an offset in the hex view, 0x... for hex
+    char *end;
+    off_t off = strtoull(cmd, &end, 0);
+    if (*end == '\0')
+      hex_move(off - E.hex.cur);
+    else
+      status_message("Invalid offset");
+  } else if (E.hex.on && strcmp(cmd, "hex") != 0 && strcmp(cmd, "q") != 0 &&
+             strcmp(cmd, "q!") != 0) {
+    // the rows are out of sight and maybe out of date
+    status_message("Not in the hex view: %s", cmd);
+  } else if (isdigit(cmd[0]) && *p == '\0') {
+    // check if cmd is a number
     int line = atoi(cmd);
     if (line > 0 && line <= E.nrows) {
       E.cur.y = line - 1;
     } else {
       status_message("Invalid line number");
     }
+  } else if (strcmp(cmd, "set wrap") == 0 || strcmp(cmd, "set nowrap") == 0) {
+    E.wrap.on = cmd[4] == 'w';
+    E.wrap.stale = 1;
+    E.wrap.sub = 0;
+  } else if ((strncmp(p, "sort", 4) == 0 || strncmp(p, "uniq", 4) == 0) &&
+             E.nrows > 0) {
+    if (!ranged) {
+      lo = 0;
+      hi = E.nrows - 1;
+      range = 0;
+    }
+    if (range == -1) {
+      status_message("Invalid range");
+    } else if (*p == 's') {
+      sort_command(lo, hi, p + 4);
+    } else if (p[4] != '\0') {
+      status_message("Usage: :[range]uniq");
+    } else if (editable()) {
+      int removed = uniq_rows(lo, hi);
+      status_message("%d fewer line%s", removed, removed == 1 ? "" : "s");
+    }
+  } else if (*p == 's' && E.nrows > 0) {
+    if (range == -1)
+      status_message("Invalid range");
+    else if (editable())
+      substitute(lo, hi, p + 1, NULL, NULL);
+  } else if ((*p == 'g' || *p == 'v') && E.nrows > 0) {
+    int invert = *p++ == 'v';
+    if (*p == '!' && !invert) {
+      invert = 1;
+      p++;
+    }
+    if (!ranged) {
+      lo = 0;
+      hi = E.nrows - 1;
+      range = 0;
+    }
+    if (range == -1)
+      status_message("Invalid range");
+    else
+      global(lo, hi, invert, p);
   } else if (strcmp(cmd, "w") == 0) {
     save();
   } else if (strcmp(cmd, "q") == 0) {
+    // a save on its way may leave the buffer clean
+    save_wait();
     if (E.dirty) {
       status_message("No write since last change (add ! to override)");
     } else {
-      die("Exit Pound");
-      exit(0);
+      quit_editor();
     }
   } else if (strcmp(cmd, "w") == 0) {
     save();
+  } else if (strcmp(cmd, "fold indent") == 0 ||
+             strcmp(cmd, "fold brace") == 0) {
+    int before = E.folds.n;
+    if (cmd[5] == 'i')
+      fold_indent();
+    else
+      fold_braces();
+    status_message("%d folds", E.folds.n - before);
+  } else if (strcmp(cmd, "hex") == 0) {
+    hex_toggle();
+  } else if (strcmp(cmd, "diff") == 0) {
+    diff_toggle();
+  } else if (strcmp(cmd, "mem") == 0 || strcmp(cmd, "mem peak") == 0) {
+    mem_report(cmd[3] != '\0');
+  } else if (strcmp(cmd, "follow") == 0) {
+    if (E.follow.ifd == -1)
+      follow_start();
+    else {
+      follow_stop();
+      status_message("Stopped following");
+    }
   } else if (strcmp(cmd, "q!") == 0) {
-    die("Exit Pound");
-    exit(0);
+    quit_editor();
   } else if (strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
     save();
-    die("Exit Pound");
-    exit(0);
+    save_wait();
+    if (!E.dirty)
+      quit_editor();
   } else {
     status_message("Command not found: %s", cmd);
   }
@@ -1294,17 +6421,33 @@ void f_mode() {
   }
 }
 
+// the highlighting a search match painted over, so it can be put back
+struct {
+  int line;
+  int len; // rows can grow under an open prompt while streaming
+  unsigned char *saved;
+} search_hl = {0, 0, NULL};
+
+void search_hl_drop() {
+  mem_free(MEM_SEARCH, search_hl.saved);
+  search_hl.saved = NULL;
+}
+
+void search_hl_restore() {
+  if (search_hl.saved && search_hl.line < E.nrows) {
+    row *r = &E.r[search_hl.line];
+    memcpy(r->hl, search_hl.saved,
+           search_hl.len < r->rsize ? search_hl.len : r->rsize);
+    change_note(CHANGE_ROWS, search_hl.line, search_hl.line);
+  }
+  search_hl_drop();
+}
+
 void search_callback(char *query, int key) {
   static int last_match = -1;
   static int direction = 1;
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(E.r[saved_hl_line].hl, saved_hl, E.r[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+  search_hl_restore();
 
   if (key == '\r' || key == '\x1b') {
     last_match = -1;
@@ -1337,11 +6480,13 @@ void search_callback(char *query, int key) {
       E.cur.x = rtcx(r, match - r->render);
       E.rowoff = E.nrows;
 
-      saved_hl_line = current;
-      saved_hl = malloc(r->rsize);
-      memcpy(saved_hl, r->hl, r->rsize);
+      search_hl.line = current;
+      search_hl.len = r->rsize;
+      search_hl.saved = mem_malloc(MEM_SEARCH, r->rsize);
+      memcpy(search_hl.saved, r->hl, r->rsize);
 
       memset(&r->hl[match - r->render], HL_MATCH, strlen(query));
+      change_note(CHANGE_ROWS, current, current);
       break;
     }
   }
@@ -1365,17 +6510,30 @@ void search() {
   }
 }
 
-void on_keypress_normal(clipboard_c *cb) {
+void on_keypress_normal() {
   int c = read_key();
+  // a count in front of a command, as in 3dd
+  if ((c >= '1' && c <= '9') || (c == '0' && E.count > 0)) {
+    E.count = E.count * 10 + c - '0';
+    return;
+  }
+  if (c > 0 && c < 128 && strchr("iaAoxpd", c) && !editable()) {
+    E.count = 0;
+    return;
+  }
+  if (c != 'd' && c != '"')
+    E.count = 0;
   switch (c) {
   case CTRL_KEY('x'):
-    die("Exit Pound");
-    exit(0);
+    quit_editor();
     break;
 
   case 'f':
     f_mode();
     break;
+  case PASTE:
+    paste();
+    break;
   case 'i':
     E.mode = INSERT;
     break;
@@ -1437,18 +6595,31 @@ void on_keypress_normal(clipboard_c *cb) {
     E.mode = INSERT;
     break;
 
+  case PAGE_UP:
+  case PAGE_DOWN:
+    page_move(c);
+    break;
+
   case '{':
     while (E.cur.y > 0 && E.r[E.cur.y].size == 0)
-      E.cur.y--;
+      E.cur.y = fold_prev(E.cur.y);
     while (E.cur.y > 0 && E.r[E.cur.y].size > 0)
-      E.cur.y--;
+      E.cur.y = fold_prev(E.cur.y);
     break;
 
   case '}':
     while (E.cur.y < E.nrows && E.r[E.cur.y].size == 0)
-      E.cur.y++;
+      E.cur.y = fold_next(E.cur.y);
     while (E.cur.y < E.nrows && E.r[E.cur.y].size > 0)
-      E.cur.y++;
+      E.cur.y = fold_next(E.cur.y);
+    break;
+
+  case 'z':
+    fold_command(read_key());
+    break;
+
+  case '%':
+    bracket_jump();
     break;
 
   case 'x':
@@ -1460,19 +6631,437 @@ void on_keypress_normal(clipboard_c *cb) {
     vim_prompt();
     break;
 
+  case '"':
+    pick_register();
+    break;
+
   case 'p':
-    paste_clipboard(cb);
+    reg_put();
     break;
 
   case 'd':
     normal_d();
     break;
 
+  case 'y':
+    normal_y();
+    break;
+
     E.hist.prev_key = c;
   }
 }
+// completion
+
+/* Ctrl-N/Ctrl-P in insert mode complete the word in front of the cursor from
+ * the words of the buffer, the most frequent first. they come out of an
+ * index: a hash table from word to id with a count per id, and the ids in
+ * word order, so the words with a given prefix are a binary search away.
+ * it is built by a worker from a snapshot of the rows the first time the
+ * editor is idle after a file is loaded. from then on every row holds the
+ * ids it added and a hash of the text they came from; when a completion is
+ * asked for, the rows the change log says were touched and whose text no
+ * longer matches take their old words out and put their new ones in, and a
+ * row that is freed takes its words with it. words seen after the build
+ * wait in a short unsorted list until there are enough to merge. */
+#define WORD_MAX 64       // longer runs aren't worth completing
+#define WORDS_FRESH 1024  // new words that are merged in one go
+
+int word_char(int c) {
+  return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+// the id of s[0..n), which is added with a count of 0 if it is new
+int words_id(struct words *wd, const char *s, int n, uint32_t h) {
+  if (wd->nw * 2 >= wd->nslots) {
+    int nslots = wd->nslots ? wd->nslots * 2 : 1024;
+    mem_free(MEM_META, wd->slots);
+    wd->slots = mem_malloc(MEM_META, sizeof(int) * nslots);
+    memset(wd->slots, -1, sizeof(int) * nslots);
+    wd->nslots = nslots;
+    for (int id = 0; id < wd->nw; id++) {
+      int k = wd->w[id].hash & (nslots - 1);
+      while (wd->slots[k] != -1)
+        k = (k + 1) & (nslots - 1);
+      wd->slots[k] = id;
+    }
+  }
+  int k = h & (wd->nslots - 1);
+  for (; wd->slots[k] != -1; k = (k + 1) & (wd->nslots - 1)) {
+    struct word *w = &wd->w[wd->slots[k]];
+    if (w->hash == h && w->len == n && memcmp(wd->text + w->off, s, n) == 0)
+      return wd->slots[k];
+  }
+  if (wd->ntext > INT_MAX - n)
+    return -1;
+  if (wd->ntext + n > wd->textcap) {
+    wd->textcap = wd->textcap ? wd->textcap : 4096;
+    while (wd->ntext + n > wd->textcap)
+      wd->textcap = wd->textcap > INT_MAX / 2 ? INT_MAX : wd->textcap * 2;
+    wd->text = mem_realloc(MEM_META, wd->text, wd->textcap);
+  }
+  if (wd->nw == wd->cap) {
+    wd->cap = wd->cap ? wd->cap * 2 : 1024;
+    wd->w = mem_realloc(MEM_META, wd->w, sizeof(struct word) * wd->cap);
+  }
+  memcpy(wd->text + wd->ntext, s, n);
+  wd->w[wd->nw] = (struct word){wd->ntext, n, 0, h};
+  wd->ntext += n;
+  wd->slots[k] = wd->nw;
+  // the build sorts everything once it is through
+  if (wd->built) {
+    if (wd->nfresh == wd->freshcap) {
+      wd->freshcap = wd->freshcap ? wd->freshcap * 2 : WORDS_FRESH;
+      wd->fresh = mem_realloc(MEM_META, wd->fresh, sizeof(int) * wd->freshcap);
+    }
+    wd->fresh[wd->nfresh++] = wd->nw;
+  }
+  return wd->nw++;
+}
+
+// counts the words of s[0..n) into the index and notes their ids in wr
+void words_take(struct words *wd, const char *s, int n, uint64_t hash,
+                struct word_row *wr) {
+  int k = 0;
+  for (int i = 0; i < n;) {
+    if (!word_char((unsigned char)s[i])) {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < n && word_char((unsigned char)s[i]))
+      i++;
+    if (i - start < 2 || i - start > WORD_MAX)
+      continue;
+    int id = words_id(wd, &s[start], i - start,
+                      text_hash(&s[start], i - start));
+    if (id == -1)
+      continue;
+    wd->w[id].count++;
+    if (k == wd->ntmp) {
+      wd->ntmp = wd->ntmp ? wd->ntmp * 2 : 256;
+      wd->tmp = realloc(wd->tmp, sizeof(int) * wd->ntmp);
+    }
+    wd->tmp[k++] = id;
+  }
+  wr->hash = hash;
+  wr->ids = NULL;
+  if (k) {
+    wr->ids = mem_malloc(MEM_META, sizeof(int) * (k + 1));
+    wr->ids[0] = k;
+    memcpy(&wr->ids[1], wd->tmp, sizeof(int) * k);
+  }
+}
+
+// takes the words of a row (or a snapshot row) back out of the index
+void words_drop(struct word_row *wr) {
+  if (wr->ids) {
+    for (int i = 1; i <= wr->ids[0]; i++)
+      E.words.w[wr->ids[i]].count--;
+    mem_free(MEM_META, wr->ids);
+  }
+  wr->ids = NULL;
+  wr->hash = 0;
+}
+
+int word_order(const void *a, const void *b) {
+  struct words *wd = &E.words;
+  struct word *x = &wd->w[*(const int *)a], *y = &wd->w[*(const int *)b];
+  int c = memcmp(wd->text + x->off, wd->text + y->off,
+                 x->len < y->len ? x->len : y->len);
+  return c ? c : x->len - y->len;
+}
+
+void *words_builder(void *arg) {
+  struct words *wd = arg;
+  for (int i = 0; i < wd->nsnap; i++) {
+    struct piece *p = &wd->snap[i];
+    words_take(wd, p->chars, p->len, text_hash(p->chars, p->len),
+               &wd->made[i]);
+  }
+  wd->sorted = mem_malloc(MEM_META, sizeof(int) * (wd->nw + 1));
+  for (int id = 0; id < wd->nw; id++)
+    wd->sorted[id] = id;
+  qsort(wd->sorted, wd->nw, sizeof(int), word_order);
+  wd->nsorted = wd->nw;
+  __atomic_store_n(&wd->done, 1, __ATOMIC_RELEASE);
+  editor_wake();
+  return NULL;
+}
+
+void words_start() {
+  struct words *wd = &E.words;
+  wd->nsnap = E.nrows;
+  wd->snap = malloc(sizeof(struct piece) * (E.nrows + 1));
+  wd->made = malloc(sizeof(struct word_row) * (E.nrows + 1));
+  wd->gen = snap_take(wd->snap);
+  wd->done = 0;
+  wd->running = 1;
+  if (pthread_create(&wd->thread, NULL, words_builder, wd) != 0)
+    words_builder(wd);
+}
+
+// where a row's text goes in a table of 2^bits slots
+uint64_t words_slot(const char *chars, int bits) {
+  return (uintptr_t)chars * 0x9e3779b97f4a7c15ull >> (64 - bits);
+}
+
+// on the main thread, once the builder is through. rows still sharing
+// their text with the snapshot are unchanged and get what was made of it;
+// the rest are indexed when a completion next looks at them
+void words_install() {
+  struct words *wd = &E.words;
+  pthread_join(wd->thread, NULL);
+  wd->running = 0;
+
+  int bits = 1;
+  while ((1 << bits) < wd->nsnap * 2)
+    bits++;
+  int *slot = malloc(sizeof(int) << bits);
+  memset(slot, -1, sizeof(int) << bits);
+  for (int j = 0; j < wd->nsnap; j++) {
+    uint64_t k = words_slot(wd->snap[j].chars, bits);
+    while (slot[k] != -1)
+      k = (k + 1) & ((1u << bits) - 1);
+    slot[k] = j;
+  }
+  for (int i = 0; i < E.nrows; i++) {
+    row *r = &E.r[i];
+    if (r->words.hash)
+      continue;
+    uint64_t k = words_slot(r->chars, bits);
+    for (; slot[k] != -1; k = (k + 1) & ((1u << bits) - 1)) {
+      struct word_row *m = &wd->made[slot[k]];
+      // two rows can share text that was put twice; one of them gets it
+      if (wd->snap[slot[k]].chars != r->chars || m->hash == 0)
+        continue;
+      r->words = *m;
+      if (r->hash == 0)
+        r->hash = m->hash;
+      m->hash = 0;
+      m->ids = NULL;
+      break;
+    }
+  }
+  free(slot);
+  // the rows that went or changed since
+  for (int j = 0; j < wd->nsnap; j++)
+    if (wd->made[j].hash)
+      words_drop(&wd->made[j]);
+  snap_release(wd->snap, wd->nsnap, wd->gen);
+  free(wd->snap);
+  free(wd->made);
+  wd->snap = NULL;
+  wd->made = NULL;
+  wd->nsnap = 0;
+  wd->built = 1;
+  wd->all = 1;
+}
+
+int words_poll() {
+  struct words *wd = &E.words;
+  if (wd->running) {
+    if (__atomic_load_n(&wd->done, __ATOMIC_ACQUIRE))
+      words_install();
+  } else if (!wd->built && E.nrows > 0 && !E.stream.active) {
+    words_start();
+  }
+  return 0;
+}
+
+// throws the index away, rows and all
+void words_clear() {
+  struct words *wd = &E.words;
+  if (wd->running) {
+    pthread_join(wd->thread, NULL);
+    wd->running = 0;
+    for (int j = 0; j < wd->nsnap; j++)
+      mem_free(MEM_META, wd->made[j].ids);
+    snap_release(wd->snap, wd->nsnap, wd->gen);
+    free(wd->snap);
+    free(wd->made);
+  }
+  for (int i = 0; i < E.nrows; i++) {
+    mem_free(MEM_META, E.r[i].words.ids);
+    E.r[i].words = (struct word_row){0, NULL};
+  }
+  mem_free(MEM_META, wd->w);
+  mem_free(MEM_META, wd->slots);
+  mem_free(MEM_META, wd->text);
+  mem_free(MEM_META, wd->sorted);
+  mem_free(MEM_META, wd->fresh);
+  free(wd->tmp);
+  free(wd->comp.prefix);
+  free(wd->comp.ids);
+  memset(wd, 0, sizeof(*wd));
+}
+
+// sorts the fresh words into the rest
+void words_merge(struct words *wd) {
+  qsort(wd->fresh, wd->nfresh, sizeof(int), word_order);
+  int n = wd->nsorted + wd->nfresh;
+  int *out = mem_malloc(MEM_META, sizeof(int) * n);
+  int i = 0, j = 0, k = 0;
+  while (i < wd->nsorted && j < wd->nfresh)
+    out[k++] = word_order(&wd->sorted[i], &wd->fresh[j]) <= 0
+                   ? wd->sorted[i++]
+                   : wd->fresh[j++];
+  while (i < wd->nsorted)
+    out[k++] = wd->sorted[i++];
+  while (j < wd->nfresh)
+    out[k++] = wd->fresh[j++];
+  mem_free(MEM_META, wd->sorted);
+  wd->sorted = out;
+  wd->nsorted = n;
+  wd->nfresh = 0;
+}
+
+// the index, built and in step with the rows
+void words_ready() {
+  struct words *wd = &E.words;
+  if (!wd->built && !wd->running)
+    words_start();
+  if (wd->running) {
+    if (!__atomic_load_n(&wd->done, __ATOMIC_ACQUIRE)) {
+      status_message("Indexing words…");
+      refresh_screen();
+    }
+    words_install();
+  }
+  int lo = 0, hi = E.nrows - 1;
+  if (!wd->all) {
+    int got = changes_since(wd->version, &lo, &hi);
+    if (got == 0)
+      return;
+    if (got == -1)
+      lo = 0, hi = E.nrows - 1;
+    if (hi >= E.nrows)
+      hi = E.nrows - 1;
+  }
+  for (int i = lo; i <= hi; i++) {
+    row *r = &E.r[i];
+    uint64_t h = row_hash(r);
+    if (r->words.hash == h)
+      continue;
+    words_drop(&r->words);
+    words_take(wd, r->chars, r->size, h, &r->words);
+  }
+  wd->all = 0;
+  wd->version = E.changes.version;
+  if (wd->nfresh >= WORDS_FRESH)
+    words_merge(wd);
+}
+
+// 0 if word id starts with s[0..n), else which side of those words it is on
+int word_prefix(struct words *wd, int id, const char *s, int n) {
+  struct word *w = &wd->w[id];
+  int c = memcmp(wd->text + w->off, s, w->len < n ? w->len : n);
+  return c ? c : w->len < n ? -1 : 0;
+}
+
+int word_rank(const void *a, const void *b) {
+  struct word *x = &E.words.w[*(const int *)a];
+  struct word *y = &E.words.w[*(const int *)b];
+  if (x->count != y->count)
+    return x->count > y->count ? -1 : 1;
+  return word_order(a, b);
+}
+
+// the words longer than s[0..n) that start with it, most frequent first
+int words_find(struct words *wd, const char *s, int n, int **out) {
+  int lo = 0, hi = wd->nsorted;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (word_prefix(wd, wd->sorted[mid], s, n) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int k = 0, cap = 0;
+  *out = NULL;
+  for (int i = lo, f = 0; i < wd->nsorted || f < wd->nfresh;) {
+    int id;
+    if (i < wd->nsorted) {
+      id = wd->sorted[i++];
+      if (word_prefix(wd, id, s, n) != 0) {
+        i = wd->nsorted;
+        continue;
+      }
+    } else {
+      id = wd->fresh[f++];
+      if (word_prefix(wd, id, s, n) != 0)
+        continue;
+    }
+    if (wd->w[id].count <= 0 || wd->w[id].len == n)
+      continue;
+    if (k == cap) {
+      cap = cap ? cap * 2 : 64;
+      *out = realloc(*out, sizeof(int) * cap);
+    }
+    (*out)[k++] = id;
+  }
+  qsort(*out, k, sizeof(int), word_rank);
+  return k;
+}
+
+// Ctrl-N (dir 1) and Ctrl-P (-1): the next or previous candidate for the
+// word in front of the cursor, and round to what was typed after the last
+void complete(int dir) {
+  struct words *wd = &E.words;
+  struct completion *cp = &wd->comp;
+  if (E.cur.y >= E.nrows)
+    return;
+  row *r = &E.r[E.cur.y];
+  if (E.cur.x > r->size)
+    E.cur.x = r->size;
+  if (!cp->active || cp->y != E.cur.y || cp->x + cp->len != E.cur.x) {
+    int x = E.cur.x;
+    while (x > 0 && word_char((unsigned char)r->chars[x - 1]))
+      x--;
+    if (x == E.cur.x) {
+      status_message("No word to complete");
+      return;
+    }
+    words_ready();
+    r = &E.r[E.cur.y];
+    free(cp->prefix);
+    free(cp->ids);
+    cp->plen = E.cur.x - x;
+    cp->prefix = strndup(&r->chars[x], cp->plen);
+    cp->n = words_find(wd, cp->prefix, cp->plen, &cp->ids);
+    if (cp->n == 0) {
+      cp->active = 0;
+      status_message("No completions for %s", cp->prefix);
+      return;
+    }
+    cp->active = 1;
+    cp->y = E.cur.y;
+    cp->x = x;
+    cp->len = cp->plen;
+    cp->pick = cp->n;
+  }
+  cp->pick = (cp->pick + dir + cp->n + 1) % (cp->n + 1);
+  const char *s = cp->prefix;
+  int len = cp->plen;
+  if (cp->pick < cp->n) {
+    struct word *w = &wd->w[cp->ids[cp->pick]];
+    s = wd->text + w->off;
+    len = w->len;
+  }
+  row_del_range(r, cp->x, cp->len);
+  row_insert(r, cp->x, s, len);
+  E.dirty++;
+  cp->len = len;
+  E.cur.x = cp->x + len;
+  if (cp->pick < cp->n)
+    status_message("Match %d of %d", cp->pick + 1, cp->n);
+  else
+    status_message("Back at original");
+}
+
 void on_keypress_insert() {
   int c = read_key();
+  if (c != CTRL_KEY('n') && c != CTRL_KEY('p'))
+    E.words.comp.active = 0;
   switch (c) {
   // disable special keys
   case '\r':
@@ -1489,9 +7078,17 @@ void on_keypress_insert() {
   case CTRL_KEY('l'):
     break;
 
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'):
+    complete(c == CTRL_KEY('n') ? 1 : -1);
+    break;
+
+  case PASTE:
+    paste();
+    break;
+
   case CTRL_KEY('x'):
-    die("Exited");
-    exit(0);
+    quit_editor();
     break;
 
   case CTRL_KEY('s'):
@@ -1513,11 +7110,9 @@ void on_keypress_insert() {
     break;
 
   case PAGE_UP:
-  case PAGE_DOWN: {
-    int times = E.ws.rows;
-    while (times--)
-      move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-  } break;
+  case PAGE_DOWN:
+    page_move(c);
+    break;
 
   case ARROW_UP:
   case ARROW_DOWN:
@@ -1532,12 +7127,6 @@ void on_keypress_insert() {
     E.cur.x--;
     break;
 
-  case '<':
-    insert_char(c);
-    insert_char('>');
-    E.cur.x--;
-    break;
-
   case '[':
     insert_char(c);
     insert_char(']');
@@ -1550,17 +7139,25 @@ void on_keypress_insert() {
     E.cur.x--;
     break;
 
-  case '\'':
-    insert_char(c);
-    insert_char('\'');
-    E.cur.x--;
-    break;
-
+  case ')':
+  case ']':
+  case '}':
   case '"':
+  case '\'': {
+    row *r = E.cur.y < E.nrows ? &E.r[E.cur.y] : NULL;
+    // typing the closer that auto-pairing already put there steps over it
+    if (r && E.cur.x < r->size && r->chars[E.cur.x] == c) {
+      E.cur.x++;
+      break;
+    }
     insert_char(c);
-    insert_char('"');
-    E.cur.x--;
-    break;
+    // quotes pair up, but not as an apostrophe inside a word
+    if ((c == '"' || c == '\'') &&
+        !(c == '\'' && E.cur.x > 1 && isalnum(r ? r->chars[E.cur.x - 2] : 0))) {
+      insert_char(c);
+      E.cur.x--;
+    }
+  } break;
 
   default:
     insert_char(c);
@@ -1570,21 +7167,38 @@ void on_keypress_insert() {
   E.hist.prev_key = c;
 }
 
-void on_keypress_visual(clipboard_c *cb) {
+void on_keypress_visual() {
 
   int c = read_key();
   switch (c) {
   case '\x1b':
     E.mode = NORMAL;
     break;
-  case 'y':
-    clipboard_set_text(cb, get_text_in_selection());
+  case '"':
+    pick_register();
+    break;
+  case 'z': {
+    struct cursor start, end;
+    if (read_key() != 'f' || selection_bounds(&start, &end) == -1)
+      break;
+    fold_add(start.y, end.y, 1);
+    E.cur.y = start.y;
     E.select->initial = E.cur;
     E.select->final = E.cur;
     E.mode = NORMAL;
-    break;
+  } break;
+  case 'y': {
+    struct cursor start, end;
+    if (selection_bounds(&start, &end) == 0)
+      reg_yank(start, end, 0);
+    E.select->initial = E.cur;
+    E.select->final = E.cur;
+    E.mode = NORMAL;
+  } break;
   case 'd':
-    delete_selection(cb);
+    if (!editable())
+      break;
+    delete_selection();
     E.select->initial = E.cur;
     E.select->final = E.cur;
     E.mode = NORMAL;
@@ -1616,27 +7230,366 @@ void on_keypress_visual(clipboard_c *cb) {
   }
 }
 
+void editor_loop() {
+  while (1) {
+    refresh_screen();
+    if (E.hex.on)
+      on_keypress_hex();
+    else if (E.mode == NORMAL)
+      on_keypress_normal();
+    else if (E.mode == INSERT)
+      on_keypress_insert();
+    else if (E.mode == VISUAL)
+      on_keypress_visual();
+  }
+}
+
+// daemon
+
+/* pound --daemon keeps buffers loaded between runs. it listens on a unix
+ * socket and gives every file its own buffer process, forked off with the
+ * editor state of just that file. pound file then only relays: it sends the
+ * path, then the keys typed and the terminal's size (as ESC[8;rows;colst),
+ * and writes out whatever frames come back. the daemon hands the
+ * connection to the file's buffer process, loading it first if need be, so
+ * reopening a file it already holds is immediate, and every terminal on the
+ * same file shares the one buffer and sees the same frames. :q and ctrl-x
+ * only detach a terminal; the buffer stays. */
+
+char *daemon_socket() {
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir && *dir)
+    snprintf(path, sizeof(path), "%s/pound.sock", dir);
+  else
+    snprintf(path, sizeof(path), "/tmp/pound-%d.sock", (int)getuid());
+  return path;
+}
+
+int send_fd(int sock, int fd) {
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  char ctl[CMSG_SPACE(sizeof(int))];
+  memset(ctl, 0, sizeof(ctl));
+  struct msghdr m = {.msg_iov = &iov,
+                     .msg_iovlen = 1,
+                     .msg_control = ctl,
+                     .msg_controllen = sizeof(ctl)};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  return sendmsg(sock, &m, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// -1 on error, -2 once the other end is closed
+int recv_fd(int sock) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  char ctl[CMSG_SPACE(sizeof(int))];
+  struct msghdr m = {.msg_iov = &iov,
+                     .msg_iovlen = 1,
+                     .msg_control = ctl,
+                     .msg_controllen = sizeof(ctl)};
+  ssize_t n = recvmsg(sock, &m, MSG_CMSG_CLOEXEC);
+  if (n <= 0)
+    return n == 0 ? -2 : -1;
+  struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+  if (c == NULL || c->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(c), sizeof(int));
+  return fd;
+}
+
+// a terminal handed over by the daemon
+void host_attach() {
+  struct host *h = &E.host;
+  int fd = recv_fd(h->ctl);
+  if (fd == -2) {
+    close(h->ctl);
+    h->ctl = -1;
+  }
+  if (fd < 0)
+    return;
+  if (h->n == HOST_CLIENTS) {
+    close(fd);
+    return;
+  }
+  // a lone escape is told from a sequence the way VTIME does it on a tty
+  struct timeval tv = {0, 100000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  h->clients[h->n++] = fd;
+  E.ttyfd = fd;
+  E.frame.valid = 0;
+}
+
+void host_detach(int fd) {
+  struct host *h = &E.host;
+  for (int i = 0; i < h->n; i++) {
+    if (h->clients[i] == fd) {
+      close(fd);
+      h->clients[i] = h->clients[--h->n];
+      break;
+    }
+  }
+  if (E.ttyfd == fd)
+    E.ttyfd = h->n > 0 ? h->clients[0] : -1;
+}
+
+// waits for the daemon or any attached terminal; a terminal that sent
+// something becomes E.ttyfd and 1 is returned
+int host_wait(int timeout) {
+  struct host *h = &E.host;
+  struct pollfd pfd[HOST_CLIENTS + 2];
+  int n = 0;
+  pfd[n++] = (struct pollfd){E.wake[0], POLLIN, 0};
+  pfd[n++] = (struct pollfd){h->ctl, POLLIN, 0};
+  for (int i = 0; i < h->n; i++)
+    pfd[n++] = (struct pollfd){h->clients[i], POLLIN, 0};
+  if (poll(pfd, n, timeout) <= 0)
+    return 0;
+  if (pfd[0].revents & POLLIN)
+    wake_drain();
+  if (pfd[1].revents & (POLLIN | POLLHUP))
+    host_attach();
+  for (int i = 2; i < n; i++) {
+    if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      E.ttyfd = pfd[i].fd;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+struct held {
+  char *path;
+  pid_t pid;
+  int ctl;
+};
+
+// forks the buffer process of path; it gets none of the daemon's sockets,
+// not even the one of the terminal it will be handed
+pid_t host_spawn(char *path, int *ctl, int listener, int client,
+                 struct held *held, int nheld) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+    return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(listener);
+    close(client);
+    close(sv[0]);
+    for (int i = 0; i < nheld; i++)
+      close(held[i].ctl);
+    signal(SIGCHLD, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    E.host.on = 1;
+    E.host.ctl = sv[1];
+    E.ttyfd = -1;
+    init_editor();
+    editor_open(strdup(path));
+    editor_loop();
+  }
+  close(sv[1]);
+  if (pid == -1) {
+    close(sv[0]);
+    return -1;
+  }
+  *ctl = sv[0];
+  return pid;
+}
+
+// reads the path a client opens with, up to its newline
+int read_path(int fd, char *path) {
+  int n = 0;
+  char c;
+  while (read(fd, &c, 1) == 1) {
+    if (c == '\n') {
+      path[n] = '\0';
+      return n > 0 ? 0 : -1;
+    }
+    if (n == PATH_MAX - 1)
+      return -1;
+    path[n++] = c;
+  }
+  return -1;
+}
+
+void daemon_run() {
+  char *sock = daemon_socket();
+  struct sockaddr_un a = {.sun_family = AF_UNIX};
+  strncpy(a.sun_path, sock, sizeof(a.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&a, sizeof(a)) == 0) {
+    fprintf(stderr, "pound: a daemon is already running on %s\n", sock);
+    exit(1);
+  }
+  // nobody answers on it, so it was left behind
+  unlink(sock);
+  if (bind(fd, (struct sockaddr *)&a, sizeof(a)) == -1 ||
+      chmod(sock, 0600) == -1 || listen(fd, 16) == -1) {
+    perror(sock);
+    exit(1);
+  }
+  printf("pound: daemon listening on %s\n", sock);
+  fflush(stdout);
+  if (fork() != 0)
+    exit(0);
+  setsid();
+  int null = open("/dev/null", O_RDWR);
+  dup2(null, STDIN_FILENO);
+  dup2(null, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+  close(null);
+  signal(SIGPIPE, SIG_IGN);
+  // finished buffer processes are reaped by the kernel
+  signal(SIGCHLD, SIG_IGN);
+
+  struct held *held = NULL;
+  int nheld = 0;
+  char path[PATH_MAX];
+  while (1) {
+    int c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if (c == -1)
+      continue;
+    if (read_path(c, path) == -1) {
+      close(c);
+      continue;
+    }
+    int i;
+    for (i = 0; i < nheld; i++)
+      if (strcmp(held[i].path, path) == 0)
+        break;
+    // a buffer process that is gone no longer takes terminals
+    if (i < nheld && send_fd(held[i].ctl, c) == -1) {
+      close(held[i].ctl);
+      free(held[i].path);
+      held[i] = held[--nheld];
+      i = nheld;
+    }
+    if (i == nheld) {
+      int ctl;
+      pid_t pid = host_spawn(path, &ctl, fd, c, held, nheld);
+      if (pid != -1) {
+        held = realloc(held, sizeof(struct held) * (nheld + 1));
+        held[nheld++] = (struct held){strdup(path), pid, ctl};
+        send_fd(ctl, c);
+      }
+    }
+    close(c);
+  }
+}
+
+volatile sig_atomic_t winched;
+
+void on_winch(int sig) {
+  (void)sig;
+  winched = 1;
+}
+
+// pound file with a daemon running: relays keys and frames until the
+// buffer process lets go. returns -1 at once if there is no daemon
+int client_run(const char *file) {
+  char path[PATH_MAX];
+  char *sock = daemon_socket();
+  struct stat st;
+  // only a socket of our own is trusted with what we type
+  if (realpath(file, path) == NULL || stat(sock, &st) == -1 ||
+      st.st_uid != getuid())
+    return -1;
+  struct sockaddr_un a = {.sun_family = AF_UNIX};
+  strncpy(a.sun_path, sock, sizeof(a.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&a, sizeof(a)) == -1) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  // realpath may have filled path to the last byte
+  if (write_all(fd, path, strlen(path)) == -1 || write_all(fd, "\n", 1) == -1)
+    return -1;
+
+  enable_raw_mode();
+  signal(SIGWINCH, on_winch);
+  winched = 1;
+  char buf[1 << 16];
+  while (1) {
+    if (winched) {
+      winched = 0;
+      struct winsize ws;
+      if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) {
+        int n = snprintf(buf, sizeof(buf), "\x1b[8;%d;%dt", ws.ws_row,
+                         ws.ws_col);
+        write_all(fd, buf, n);
+      }
+    }
+    struct pollfd pfd[2] = {{E.ttyfd, POLLIN, 0}, {fd, POLLIN, 0}};
+    if (poll(pfd, 2, -1) == -1)
+      continue;
+    if (pfd[0].revents & POLLIN) {
+      int n = read(E.ttyfd, buf, sizeof(buf));
+      if (n > 0 && write_all(fd, buf, n) == -1)
+        break;
+    }
+    if (pfd[1].revents & (POLLIN | POLLHUP)) {
+      int n = read(fd, buf, sizeof(buf));
+      if (n <= 0)
+        break;
+      write_all(STDOUT_FILENO, buf, n);
+    }
+  }
+  exit(0);
+}
+
 // taking in arguments
+// bench/bench.c brings its own
+#ifndef POUND_BENCH
 int main(int argc, char *argv[]) {
   setlocale(LC_ALL, "");
+  // with stdin being the data, keys have to come from the terminal itself
+  int from_stdin = (argc >= 2 && strcmp(argv[argc - 1], "-") == 0) ||
+                   (argc < 2 && !isatty(STDIN_FILENO));
+  E.ttyfd = STDIN_FILENO;
+  if (from_stdin) {
+    E.ttyfd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (E.ttyfd == -1)
+      die("/dev/tty");
+  }
+  if (argc == 2 && strcmp(argv[1], "--daemon") == 0)
+    daemon_run();
+  // with a daemon running, files are opened in it
+  if (argc == 2 && !from_stdin && argv[1][0] != '-')
+    client_run(argv[1]);
   enable_raw_mode();
   init_editor();
-  clipboard_c *c = clipboard_new(NULL);
-  if (argc >= 2) {
-    editor_open(argv[1]);
+  int follow = 0, hex = 0;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-f") == 0) {
+    follow = 1;
+    arg++;
+  } else if (arg < argc && strcmp(argv[arg], "-x") == 0) {
+    hex = 1;
+    arg++;
   }
-
-  status_message("HELP: :q = quit");
-
-  while (1) {
-    refresh_screen();
-    if (E.mode == NORMAL)
-      on_keypress_normal(c);
-    else if (E.mode == INSERT)
-      on_keypress_insert();
-    else if (E.mode == VISUAL)
-      on_keypress_visual(c);
+  if (from_stdin) {
+    stream_start(STDIN_FILENO, stream_reader);
+  } else if (hex && arg < argc) {
+    // the rows are only read if the view is left
+    E.filename = strdup(argv[arg]);
+    if (hex_open(E.filename) == -1)
+      die("open");
+  } else if (arg < argc) {
+    editor_open(strdup(argv[arg]));
+    if (follow)
+      follow_start();
   }
 
+  if (E.statusmsg[0] == '\0')
+    status_message("HELP: :q = quit");
+
+  editor_loop();
   return 0;
 }
+#endif